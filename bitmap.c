@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "bitmap.h"
+
+struct dirty_blocks *dirty_blocks_new(guint64 block_size, gsize filesize)
+{
+	struct dirty_blocks *dirty = g_new0(struct dirty_blocks, 1);
+
+	dirty->block_size = block_size;
+	dirty->block_count = (filesize + block_size - 1) / block_size;
+	dirty->bits = g_malloc0(QC_MASK_BYTES(dirty->block_count));
+
+	return dirty;
+}
+
+void dirty_blocks_free(struct dirty_blocks *dirty)
+{
+	if (!dirty) {
+		return;
+	}
+
+	g_free(dirty->bits);
+	g_free(dirty);
+}
+
+static gboolean block_is_dirty(struct dirty_blocks *dirty, guint64 i)
+{
+	return (dirty->bits[i / 8] >> (i % 8)) & 1;
+}
+
+/*
+ * The byte ranges of a chunk that take part in the session, in file order.
+ * Without dirty blocks that is the whole chunk, otherwise every run of dirty
+ * blocks within it. partial tells whether that is less than the whole chunk.
+ */
+GArray *chunk_extents(struct cs_data *cs, gint64 num, gboolean *partial)
+{
+	GArray *extents = g_array_new(FALSE, FALSE, sizeof(struct extent));
+	off_t start = (off_t)(num - 1) * QC_CHUNK_SIZE;
+	off_t end = MIN(start + (off_t) QC_CHUNK_SIZE, (off_t) cs->filesize);
+	struct dirty_blocks *dirty = cs->dirty;
+	struct extent ext = { start, end - start };
+
+	*partial = FALSE;
+
+	if (!dirty) {
+		g_array_append_val(extents, ext);
+		return extents;
+	}
+
+	guint64 last = (end - 1) / dirty->block_size;
+
+	for (guint64 i = start / dirty->block_size; i <= last;) {
+		guint64 first = i;
+
+		while (i <= last && block_is_dirty(dirty, i)) {
+			i++;
+		}
+
+		if (i == first) {
+			i++;
+			continue;
+		}
+
+		ext.offset = MAX((off_t)(first * dirty->block_size), start);
+		ext.size = MIN((off_t)(i * dirty->block_size), end) - ext.offset;
+		g_array_append_val(extents, ext);
+	}
+
+	*partial = extents->len != 1 || g_array_index(extents, struct extent, 0).size !=
+	           (gsize)(end - start);
+
+	return extents;
+}
+
+gsize extents_size(GArray *extents)
+{
+	gsize size = 0;
+
+	for (guint i = 0; i < extents->len; i++) {
+		size += g_array_index(extents, struct extent, i).size;
+	}
+
+	return size;
+}
+
+/* Bytes a chunk contributes to the session, all of it or its dirty extents */
+gsize chunk_data_size(struct cs_data *cs, gint64 num)
+{
+	gboolean partial;
+	GArray *extents = chunk_extents(cs, num, &partial);
+	gsize size = extents_size(extents);
+
+	g_array_free(extents, TRUE);
+
+	return size;
+}
+
+static guint64 selected_bytes(struct cs_data *cs)
+{
+	guint64 bytes = 0;
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		if (chunk_is_selected(cs, num)) {
+			bytes += chunk_data_size(cs, num);
+		}
+	}
+
+	return bytes;
+}
+
+/* Read the extents one after the other into buf */
+gint read_extents(FILE *fp, GArray *extents, gchar *buf)
+{
+	for (guint i = 0; i < extents->len; i++) {
+		struct extent *ext = &g_array_index(extents, struct extent, i);
+
+		if ((ftello(fp) != ext->offset && fseeko(fp, ext->offset, SEEK_SET)) ||
+		    fread(buf, 1, ext->size, fp) != ext->size) {
+			return -1;
+		}
+
+		buf += ext->size;
+	}
+
+	return 0;
+}
+
+/*
+ * Clear every chunk from the session mask that has no changed block according
+ * to the bitmap, so neither side reads it. Within the other chunks, only the
+ * changed blocks are read, unless the bitmap blocks are too small for that.
+ */
+gint load_dirty_bitmap(struct cs_data *cs, const gchar *filename)
+{
+	GError *error = NULL;
+	gchar *contents;
+	gsize length;
+	guint64 block_size, block_count;
+	const guint8 *bits;
+
+	if (!g_file_get_contents(filename, &contents, &length, &error)) {
+		g_critical("Unable to read dirty bitmap: %s", error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	switch (qc_bitmap_parse((const guint8 *)contents, length, &block_size,
+	                        &block_count)) {
+	case QC_BITMAP_OK:
+		break;
+	case QC_BITMAP_NO_BITMAP:
+		g_critical("%s is no dirty bitmap", filename);
+		g_free(contents);
+		return -1;
+	default:
+		g_critical("Dirty bitmap %s is truncated or has an invalid block size or count",
+		           filename);
+		g_free(contents);
+		return -1;
+	}
+
+	bits = (const guint8 *)contents + QC_BITMAP_HEADER_SIZE;
+
+	g_debug("Dirty bitmap: block size %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT
+	        " blocks", block_size, block_count);
+
+	if (block_size * block_count < cs->filesize) {
+		g_warning("Dirty bitmap covers only %" G_GUINT64_FORMAT " of %" G_GSIZE_FORMAT
+		          " bytes, treating the rest as changed", block_size * block_count,
+		          cs->filesize);
+	}
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		guint64 start = (num - 1) * QC_CHUNK_SIZE;
+		guint64 end = MIN(start + QC_CHUNK_SIZE, cs->filesize);
+
+		if (!qc_bitmap_range_dirty(bits, block_size, block_count, start, end)) {
+			chunk_mask_clear(cs->chunk_mask, num);
+		}
+	}
+
+	if (cs->patch_filename) {
+		/* Patch records hold whole chunks */
+		g_message("Dirty bitmap used for whole chunks only, --patch needs them");
+	} else if (block_size < QC_MIN_DIRTY_BLOCK) {
+		g_message("Dirty bitmap blocks below %d bytes, reading whole chunks",
+		          QC_MIN_DIRTY_BLOCK);
+	} else {
+		cs->dirty = dirty_blocks_new(block_size, cs->filesize);
+
+		/* Blocks beyond the end of the bitmap count as changed */
+		for (guint64 i = 0; i < cs->dirty->block_count; i++) {
+			if (i >= block_count || ((bits[i / 8] >> (i % 8)) & 1)) {
+				cs->dirty->bits[i / 8] |= 1 << (i % 8);
+			}
+		}
+	}
+
+	g_free(contents);
+
+	g_message("Dirty bitmap selects %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+	          " chunks, %" G_GUINT64_FORMAT " bytes to read", chunk_mask_count(cs),
+	          cs->chunk_count, selected_bytes(cs));
+
+	return 0;
+}
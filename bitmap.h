@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_BITMAP_H
+#define QUICKCHUNK_BITMAP_H
+
+#include "quickchunk.h"
+
+/* The file format is in protocol.h, quickchunk-mini reads it as well */
+gint load_dirty_bitmap(struct cs_data *cs, const gchar *filename);
+struct dirty_blocks *dirty_blocks_new(guint64 block_size, gsize filesize);
+void dirty_blocks_free(struct dirty_blocks *dirty);
+GArray *chunk_extents(struct cs_data *cs, gint64 num, gboolean *partial);
+gsize extents_size(GArray *extents);
+gsize chunk_data_size(struct cs_data *cs, gint64 num);
+gint read_extents(FILE *fp, GArray *extents, gchar *buf);
+
+#endif //QUICKCHUNK_BITMAP_H
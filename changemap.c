@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "changemap.h"
+
+/* Hash size zero bytes in blocks, without allocating a whole chunk */
+static XXH128_hash_t get_zero_hash128(gsize size)
+{
+	gchar *zeros = g_malloc0(QC_IO_BLOCK_SIZE);
+	XXH3_state_t *state = hash128_stream_new();
+
+	for (gsize left = size; left; left -= MIN(left, QC_IO_BLOCK_SIZE)) {
+		hash128_stream_update(state, zeros, MIN(left, QC_IO_BLOCK_SIZE));
+	}
+
+	g_free(zeros);
+
+	return hash128_stream_finish(state);
+}
+
+/* Every map of a full chunk needs the same hash, compute it once */
+static XXH128_hash_t get_zero_chunk_hash128(void)
+{
+	static XXH128_hash_t hash;
+	static gsize initialized;
+
+	if (g_once_init_enter(&initialized)) {
+		hash = get_zero_hash128(QC_CHUNK_SIZE);
+		g_once_init_leave(&initialized, 1);
+	}
+
+	return hash;
+}
+
+struct change_map *changemap_new(struct cs_data *cs)
+{
+	struct change_map *map = g_new0(struct change_map, 1);
+	gsize tail = cs->filesize % QC_CHUNK_SIZE;
+
+	map->chunk_count = cs->chunk_count;
+	map->filesize = cs->filesize;
+	map->start_time = g_get_real_time();
+	map->entries = g_new0(struct change_entry, cs->chunk_count);
+
+	/* Zero chunks are recognized by their hash, data is not always at hand */
+	map->zero_hash = get_zero_chunk_hash128();
+
+	if (tail) {
+		map->zero_hash_tail = get_zero_hash128(tail);
+	}
+
+	return map;
+}
+
+void changemap_set(struct change_map *map, struct chunk *chnk,
+                   enum QCChange state)
+{
+	struct change_entry *entry = &map->entries[chnk->num - 1];
+	XXH128_hash_t zero_hash;
+
+	zero_hash = chnk->size == QC_CHUNK_SIZE ? map->zero_hash : map->zero_hash_tail;
+
+	entry->time = g_get_real_time();
+	entry->hash = chnk->hash;
+	entry->state = state;
+	/* A partial chunk's hash says nothing about the rest of it */
+	entry->flags = !chnk->partial &&
+	               are_hashes_equal(chnk->hash, zero_hash) ? QC_CHANGE_FLAG_ZERO : 0;
+}
+
+gint changemap_save(struct change_map *map, const gchar *filename)
+{
+	FILE *fp;
+	gint ret = 0;
+
+	fp = g_fopen(filename, "w");
+
+	if (!fp) {
+		g_critical("Unable to create change map %s", filename);
+		return -1;
+	}
+
+	if (fwrite(QC_CHANGEMAP_MAGIC, strlen(QC_CHANGEMAP_MAGIC), 1, fp) != 1 ||
+	    fwrite_le64(fp, QC_CHUNK_SIZE) ||
+	    fwrite_le64(fp, map->filesize) ||
+	    fwrite_le64(fp, map->chunk_count) ||
+	    fwrite_le64(fp, map->start_time) ||
+	    fwrite_le64(fp, g_get_real_time())) {
+		ret = -1;
+	}
+
+	for (guint64 i = 0; !ret && i < map->chunk_count; i++) {
+		struct change_entry *entry = &map->entries[i];
+		guint32 state_flags[2] = {
+			GUINT32_TO_LE(entry->state), GUINT32_TO_LE(entry->flags)
+		};
+
+		if (fwrite_le64(fp, entry->time) || fwrite_hash128(fp, entry->hash) ||
+		    fwrite(state_flags, sizeof(state_flags), 1, fp) != 1) {
+			ret = -1;
+		}
+	}
+
+	if (fclose(fp) || ret) {
+		g_critical("Failed to write change map %s", filename);
+		return -1;
+	}
+
+	g_debug("Wrote change map %s", filename);
+
+	return 0;
+}
+
+void changemap_free(struct change_map *map)
+{
+	if (!map) {
+		return;
+	}
+
+	g_free(map->entries);
+	g_free(map);
+}
+
+static struct change_map *changemap_load(const gchar *filename)
+{
+	struct change_map *map;
+	gchar magic[sizeof(QC_CHANGEMAP_MAGIC) - 1];
+	guint64 chunk_size, filesize, end_time;
+	FILE *fp;
+
+	fp = g_fopen(filename, "r");
+
+	if (!fp) {
+		g_critical("Unable to open change map %s", filename);
+		return NULL;
+	}
+
+	map = g_new0(struct change_map, 1);
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, QC_CHANGEMAP_MAGIC, sizeof(magic)) != 0 ||
+	    fread_le64(fp, &chunk_size) || fread_le64(fp, &filesize) ||
+	    fread_le64(fp, &map->chunk_count) ||
+	    fread_le64(fp, (guint64 *)&map->start_time) || fread_le64(fp, &end_time)) {
+		g_critical("%s is no change map", filename);
+		goto err;
+	}
+
+	if (chunk_size != QC_CHUNK_SIZE ||
+	    map->chunk_count != (filesize + QC_CHUNK_SIZE - 1) / QC_CHUNK_SIZE) {
+		g_critical("Change map %s has an unsupported layout", filename);
+		goto err;
+	}
+
+	map->filesize = filesize;
+	map->entries = g_new0(struct change_entry, map->chunk_count);
+
+	for (guint64 i = 0; i < map->chunk_count; i++) {
+		struct change_entry *entry = &map->entries[i];
+		guint32 state_flags[2];
+
+		if (fread_le64(fp, (guint64 *)&entry->time) ||
+		    fread_hash128(fp, &entry->hash) ||
+		    fread(state_flags, sizeof(state_flags), 1, fp) != 1) {
+			g_critical("Change map %s is truncated", filename);
+			goto err;
+		}
+
+		entry->state = GUINT32_FROM_LE(state_flags[0]);
+		entry->flags = GUINT32_FROM_LE(state_flags[1]);
+	}
+
+	fclose(fp);
+
+	return map;
+
+err:
+	fclose(fp);
+	changemap_free(map);
+
+	return NULL;
+}
+
+/*
+ * Merge the change maps of several sessions into a CSV heatmap with one line
+ * per chunk, so downstream jobs can pick the ranges that actually change.
+ */
+gint write_heatmap(const gchar *filename, gchar **maps)
+{
+	struct change_map *merged = NULL;
+	guint64 *compared = NULL, *dirty = NULL, *zero = NULL;
+	gint64 *last_dirty = NULL;
+	guint n_maps = 0;
+	FILE *fp;
+	gint ret = -1;
+
+	if (!maps || !*maps) {
+		g_critical("No change maps to merge");
+		return -1;
+	}
+
+	for (gchar **path = maps; *path; path++) {
+		struct change_map *map = changemap_load(*path);
+
+		if (!map) {
+			goto out;
+		}
+
+		if (!merged) {
+			merged = map;
+			compared = g_new0(guint64, map->chunk_count);
+			dirty = g_new0(guint64, map->chunk_count);
+			zero = g_new0(guint64, map->chunk_count);
+			last_dirty = g_new0(gint64, map->chunk_count);
+		} else if (map->filesize != merged->filesize ||
+		           map->chunk_count != merged->chunk_count) {
+			/* Equal chunk counts still leave the last chunk's range ambiguous */
+			g_critical("Change map %s belongs to a file of different size (%"
+			           G_GSIZE_FORMAT " instead of %" G_GSIZE_FORMAT " bytes)", *path,
+			           map->filesize, merged->filesize);
+			changemap_free(map);
+			goto out;
+		}
+
+		for (guint64 i = 0; i < map->chunk_count; i++) {
+			struct change_entry *entry = &map->entries[i];
+
+			if (entry->state == QC_CHANGE_SKIPPED) {
+				continue;
+			}
+
+			compared[i]++;
+			zero[i] += !!(entry->flags & QC_CHANGE_FLAG_ZERO);
+
+			if (entry->state != QC_CHANGE_EQUAL) {
+				dirty[i]++;
+				last_dirty[i] = MAX(last_dirty[i], entry->time);
+			}
+		}
+
+		if (map != merged) {
+			changemap_free(map);
+		}
+
+		n_maps++;
+	}
+
+	fp = g_fopen(filename, "w");
+
+	if (!fp) {
+		g_critical("Unable to create heatmap %s", filename);
+		goto out;
+	}
+
+	fprintf(fp, "chunk,offset,size,sessions,dirty,zero,heat,last_dirty\n");
+
+	for (guint64 i = 0; i < merged->chunk_count; i++) {
+		guint64 offset = i * QC_CHUNK_SIZE;
+		gchar *last = g_strdup("");
+
+		if (last_dirty[i]) {
+			GDateTime *dt = g_date_time_new_from_unix_utc(last_dirty[i] / G_USEC_PER_SEC);
+
+			g_free(last);
+			last = g_date_time_format_iso8601(dt);
+			g_date_time_unref(dt);
+		}
+
+		fprintf(fp, "%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT
+		        ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT ",%" G_GUINT64_FORMAT
+		        ",%.3f,%s\n", i + 1, offset,
+		        MIN(QC_CHUNK_SIZE, merged->filesize - offset), compared[i], dirty[i],
+		        zero[i], compared[i] ? (gdouble) dirty[i] / compared[i] : 0.0, last);
+		g_free(last);
+	}
+
+	ret = fclose(fp);
+	fp = NULL;
+
+	if (ret) {
+		g_critical("Failed to write heatmap %s", filename);
+		goto out;
+	}
+
+	g_message("Merged %u change maps into %s", n_maps, filename);
+
+out:
+	changemap_free(merged);
+	g_free(compared);
+	g_free(dirty);
+	g_free(zero);
+	g_free(last_dirty);
+
+	return ret ? -1 : 0;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_CHANGEMAP_H
+#define QUICKCHUNK_CHANGEMAP_H
+
+#include "quickchunk.h"
+
+/*
+ * Change map file of one session, all integers little endian:
+ *
+ *   8 bytes   magic "QCCHMAP1"
+ *   8 bytes   chunk size
+ *   8 bytes   file size
+ *   8 bytes   number of chunks
+ *   8 bytes   session start, microseconds since the epoch
+ *   8 bytes   session end, microseconds since the epoch
+ *
+ * followed by one 32 byte record per chunk
+ *
+ *   8 bytes   time the chunk was handled, microseconds since the epoch
+ *   16 bytes  XXH3-128 hash (low64, high64) of the new content, only of
+ *             its dirty blocks when the session read the chunk partially
+ *   4 bytes   state (enum QCChange)
+ *   4 bytes   flags (QC_CHANGE_FLAG_*)
+ */
+#define QC_CHANGEMAP_MAGIC      "QCCHMAP1"
+
+enum QCChange {
+	QC_CHANGE_SKIPPED,	/* not compared, e.g. clean in the dirty bitmap */
+	QC_CHANGE_EQUAL,
+	QC_CHANGE_DIRTY,
+	QC_CHANGE_COPIED	/* dirty, but copied from another offset */
+};
+
+#define QC_CHANGE_FLAG_ZERO     (1 << 0)	/* content is all zeros */
+
+struct change_entry {
+	gint64 time;
+	XXH128_hash_t hash;
+	guint32 state;
+	guint32 flags;
+};
+
+struct change_map {
+	guint64 chunk_count;
+	gsize filesize;
+	gint64 start_time;
+	XXH128_hash_t zero_hash;	/* of a full chunk of zeros */
+	XXH128_hash_t zero_hash_tail;	/* of a last, shorter chunk of zeros */
+	struct change_entry *entries;
+};
+
+struct change_map *changemap_new(struct cs_data *cs);
+void changemap_set(struct change_map *map, struct chunk *chnk,
+                   enum QCChange state);
+gint changemap_save(struct change_map *map, const gchar *filename);
+void changemap_free(struct change_map *map);
+gint write_heatmap(const gchar *filename, gchar **maps);
+
+#endif //QUICKCHUNK_CHANGEMAP_H
@@ -4,36 +4,151 @@
  */
 
 #include "client.h"
+#include "bitmap.h"
+#include "manifest.h"
+#include "patch.h"
+#include "changemap.h"
+#include "plan.h"
+#include "history.h"
+
+struct cs_client *client_new(struct cs_data *cs, const gchar *destination)
+{
+	struct cs_client *client;
+	GSocketConnectable *addr;
+	GError *error = NULL;
+
+	addr = g_network_address_parse(destination, cs->server_port, &error);
+
+	if (!addr) {
+		g_error("Invalid destination \"%s\": %s", destination, error->message);
+	}
+
+	client = g_new0(struct cs_client, 1);
+	client->cs = cs;
+	client->server_ip = g_strdup(g_network_address_get_hostname(G_NETWORK_ADDRESS(
+	                                     addr)));
+	client->server_port = g_network_address_get_port(G_NETWORK_ADDRESS(addr));
+	client->name = g_strdup_printf("%s:%u", client->server_ip, client->server_port);
+	client->async_queue = g_async_queue_new();
+
+	g_object_unref(addr);
 
-gint init_client(struct cs_data *cs)
+	return client;
+}
+
+struct cs_client *client_new_file(struct cs_data *cs, enum QCDestination kind,
+                                  const gchar *filename)
+{
+	struct cs_client *client;
+
+	client = g_new0(struct cs_client, 1);
+	client->cs = cs;
+	client->kind = kind;
+	client->name = g_strdup(filename);
+	client->async_queue = g_async_queue_new();
+
+	return client;
+}
+
+void client_free(struct cs_client *client)
+{
+	g_async_queue_unref(client->async_queue);
+	g_free(client->server_ip);
+	g_free(client->name);
+	g_free(client->change_map_filename);
+	changemap_free(client->change_map);
+	g_free(client->plan);
+	g_free(client->history_filename);
+	history_free(client->history);
+
+	if (client->in_flight) {
+		g_queue_free(client->in_flight);
+	}
+
+	g_free(client);
+}
+
+gint init_client(struct cs_client *client)
 {
 	GError *error = NULL;
 
-	if (!cs->client->client) {	// not yet initialized
-		cs->client->client = g_socket_client_new();
-		cs->client->connection = g_socket_client_connect_to_host(cs->client->client,
-		                         cs->server_ip, cs->server_port, NULL, &error);
+	if (!client->client) {	// not yet initialized
+		client->client = g_socket_client_new();
+		client->connection = g_socket_client_connect_to_host(client->client,
+		                     client->server_ip, client->server_port, NULL, &error);
 
-		if (!cs->client->connection) {
-			g_error("Failed to connect: %s", error->message);
+		if (!client->connection) {
+			g_error("Failed to connect to %s:%u: %s", client->server_ip,
+			        client->server_port, error->message);
 		}
 
-		cs->client->input_stream = g_io_stream_get_input_stream(G_IO_STREAM(
-		                                   cs->client->connection));
-		cs->client->output_stream = g_io_stream_get_output_stream(G_IO_STREAM(
-		                                    cs->client->connection));
+		client->input_stream = g_io_stream_get_input_stream(G_IO_STREAM(
+		                               client->connection));
+		client->output_stream = g_io_stream_get_output_stream(G_IO_STREAM(
+		                                client->connection));
+	}
+
+	return 0;
+}
+
+gint deinit_client(struct cs_client *client)
+{
+	if (client->client) {
+		g_object_unref(client->client);
+		g_object_unref(client->connection);
+	}
+
+	if (client->fp) {
+		fclose(client->fp);
 	}
 
 	return 0;
 }
 
-gint deinit_client(struct cs_data *cs)
+/*
+ * A destination that fell behind only got the hash of a chunk queued, not its
+ * data. Read the chunk again, but only now that the server asked for it.
+ */
+gint client_reread_chunk(struct cs_client *client, struct chunk *chnk)
 {
-	if (cs->client->client) {
-		g_object_unref(cs->client->client);
-		g_object_unref(cs->client->connection);
+	struct cs_data *cs = client->cs;
+	XXH128_hash_t hash;
+	GArray *extents;
+	gboolean partial;
+
+	if (!client->fp) {
+		client->fp = g_fopen(cs->filename, "r");
+
+		if (!client->fp) {
+			g_critical("Unable to open file <%s>: %s", __func__, cs->filename);
+			return -1;
+		}
+	}
+
+	extents = chunk_extents(cs, chnk->num, &partial);
+	chnk->data = (gchar *) g_malloc(chnk->size * sizeof(gchar));
+
+	if (extents_size(extents) != chnk->size ||
+	    read_extents(client->fp, extents, chnk->data)) {
+		g_critical("Failed to read %lu bytes of chunk %" G_GINT64_FORMAT, chnk->size,
+		           chnk->num);
+		g_array_free(extents, TRUE);
+		return -1;
 	}
 
+	g_array_free(extents, TRUE);
+
+	hash = get_hash128(chnk->data, chnk->size);
+
+	if (hash.low64 != chnk->hash.low64 || hash.high64 != chnk->hash.high64) {
+		g_critical("Chunk %" G_GINT64_FORMAT " changed since it was hashed",
+		           chnk->num);
+		return -1;
+	}
+
+	client->chunks_reread++;
+	g_debug("%s: re-read chunk %" G_GINT64_FORMAT, client->name, chnk->num);
+
 	return 0;
 }
 
@@ -64,6 +179,12 @@ static enum QCResponse wait_and_get_response(GInputStream *input_stream)
 	} else if (g_strcmp0(msg_received, QC_EQL_MESSAGE) == 0) {
 		g_debug("GOT EQL: %s", msg_received);
 		return QC_RESPONSE_EQL;
+	} else if (g_strcmp0(msg_received, QC_CPY_MESSAGE) == 0) {
+		g_debug("GOT CPY: %s", msg_received);
+		return QC_RESPONSE_CPY;
+	} else if (g_strcmp0(msg_received, QC_RTY_MESSAGE) == 0) {
+		g_debug("GOT RTY: %s", msg_received);
+		return QC_RESPONSE_RTY;
 	}
 
 	g_error("Unknown msg received (%s) from server, aborting.", msg_received);
@@ -92,34 +213,127 @@ gint send_data(GOutputStream *output_stream, gpointer data, gsize size,
 	}
 }
 
-gint client_check_and_upload(struct cs_data *cs, struct chunk *chnk)
+gint client_send_session_header(struct cs_client *client)
 {
-	GInputStream *input_stream = cs->client->input_stream;
-	GOutputStream *output_stream = cs->client->output_stream;
-	enum QCResponse resp;
+	struct cs_data *cs = client->cs;
+	GOutputStream *output_stream = client->output_stream;
+
+	// Send version, filesize and which chunks take part in this session
+	struct qc_preamble pre = {
+		.version = PROJECT_VERSION,
+		.filesize = cs->filesize,
+		.chunk_count = cs->chunk_count,
+	};
+	guint8 preamble[QC_PREAMBLE_SIZE];
+
+	qc_preamble_encode(preamble, &pre);
+
+	if (send_data(output_stream, preamble, sizeof(preamble),
+	              "Error writing session header") != 0) {
+		return -1;
+	}
+
+	g_debug("Sent version: %s, filesize: %" G_GSIZE_FORMAT, pre.version,
+	        cs->filesize);
 
-	if (!cs->misc_sent) {
-		// Send version
-		gchar version_str[VERSION_LENGTH] = PROJECT_VERSION;
+	if (send_data(output_stream, cs->chunk_mask, QC_MASK_BYTES(cs->chunk_count),
+	              "Error writing chunk mask") != 0) {
+		return -1;
+	}
+
+	g_debug("Sent chunk mask, %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+	        " chunks selected", chunk_mask_count(cs), cs->chunk_count);
+
+	// Send session flags
+	guint64 flags = (cs->time_budget ? QC_SESSION_ROLLING : 0) |
+	                (cs->plan ? QC_SESSION_PLAN : 0) |
+	                (cs->speculate ? QC_SESSION_SPECULATE : 0) |
+	                (cs->dirty ? QC_SESSION_PARTIAL : 0);
+
+	if (send_data(output_stream, &flags, sizeof(flags),
+	              "Error writing session flags") != 0) {
+		return -1;
+	}
+
+	// Send the dirty blocks, the server reads only these as well
+	if (flags & QC_SESSION_PARTIAL) {
+		guint64 blocks[2] = { cs->dirty->block_size, cs->dirty->block_count };
+
+		if (send_data(output_stream, blocks, sizeof(blocks),
+		              "Error writing dirty block size") != 0 ||
+		    send_data(output_stream, cs->dirty->bits,
+		              QC_MASK_BYTES(cs->dirty->block_count),
+		              "Error writing dirty blocks") != 0) {
+			return -1;
+		}
+	}
+
+	if (flags & QC_SESSION_SPECULATE) {
+		guint64 budget = cs->speculate;
+		GError *error = NULL;
+		gsize bytes_read;
 
-		if (send_data(output_stream, version_str, VERSION_LENGTH,
-		              "Error writing version") != 0) {
+		if (send_data(output_stream, &budget, sizeof(budget),
+		              "Error writing in-flight budget") != 0) {
 			return -1;
 		}
 
-		g_debug("Sent version: %s", version_str);
+		// Read how many the server is willing to hold in memory
+		if (!g_input_stream_read_all(client->input_stream, &client->spec_budget,
+		                             sizeof(client->spec_budget), &bytes_read, NULL,
+		                             &error)) {
+			g_critical("Error reading in-flight budget: %s", error->message);
+			g_error_free(error);
+			return -1;
+		}
+
+		if (bytes_read != sizeof(client->spec_budget) || !client->spec_budget ||
+		    client->spec_budget > budget) {
+			g_critical("Protocol error: invalid in-flight budget");
+			return -1;
+		}
+
+		if (client->spec_budget < budget) {
+			g_message("%s: server accepts %" G_GUINT64_FORMAT
+			          " speculative chunks in flight", client->name, client->spec_budget);
+		}
+	}
+
+	if (flags & QC_SESSION_ROLLING) {
+		GError *error = NULL;
+		gsize bytes_read;
+		guint64 cursor;
+
+		// Read where the previous window stopped
+		if (!g_input_stream_read_all(client->input_stream, &cursor, sizeof(cursor),
+		                             &bytes_read, NULL, &error)) {
+			g_critical("Error reading cursor: %s", error->message);
+			g_error_free(error);
+			return -1;
+		}
 
-		// Send filesize
-		if (send_data(output_stream, &cs->filesize, sizeof(cs->filesize),
-		              "Error writing filesize") != 0) {
+		if (bytes_read != sizeof(cursor) || !cursor ||
+		    cursor > MAX(cs->chunk_count, 1)) {
+			g_critical("Protocol error: invalid cursor");
 			return -1;
 		}
 
-		g_debug("Sent filesize: %" G_GSIZE_FORMAT, cs->filesize);
+		g_message("Rolling session, starting at chunk %" G_GUINT64_FORMAT, cursor);
 
-		cs->misc_sent = TRUE;
+		g_mutex_lock(&cs->mutex);
+		cs->cursor = cursor;
+		g_cond_broadcast(&cs->cond);
+		g_mutex_unlock(&cs->mutex);
 	}
 
+	return 0;
+}
+
+static gint send_chunk_header(struct cs_client *client, struct chunk *chnk,
+                              guint64 flags)
+{
+	GOutputStream *output_stream = client->output_stream;
+
 	// Send chunk num
 	if (send_data(output_stream, &chnk->num, sizeof(chnk->num),
 	              "Error writing chunk num") != 0) {
@@ -128,21 +342,200 @@ gint client_check_and_upload(struct cs_data *cs, struct chunk *chnk)
 
 	g_debug("Sent chunk num: %" G_GINT64_FORMAT, chnk->num);
 
-	// Send chunk size
-	if (send_data(output_stream, &chnk->size, sizeof(chnk->size),
-	              "Error writing chunk size") != 0) {
+	// Send chunk size, hash and flags
+	struct qc_record rec = {
+		.size = chnk->size,
+		.hash_low64 = chnk->hash.low64,
+		.hash_high64 = chnk->hash.high64,
+		.flags = flags,
+	};
+	guint8 record[QC_RECORD_SIZE];
+
+	qc_record_encode(record, &rec);
+
+	if (send_data(output_stream, record, sizeof(record),
+	              "Error writing chunk header") != 0) {
+		return -1;
+	}
+
+	g_debug("Sent chunk size: %" G_GSIZE_FORMAT ", hash: 0x%lx%lx", chnk->size,
+	        chnk->hash.high64, chnk->hash.low64);
+
+	return 0;
+}
+
+static void client_chunk_done(struct cs_client *client, struct chunk *chnk,
+                              enum QCChange state)
+{
+	if (client->change_map) {
+		changemap_set(client->change_map, chnk, state);
+	}
+
+	if (client->plan) {
+		plan_record(client->plan, chnk, state);
+	}
+
+	if (client->history) {
+		history_record(client->history, chnk->num, state != QC_CHANGE_EQUAL);
+	}
+}
+
+/* Entry of the in-flight queue, a NULL chunk stands for a flush */
+struct in_flight {
+	struct chunk *chnk;
+	guint retries;
+};
+
+static gint send_speculative(struct cs_client *client, struct chunk *chnk,
+                             guint64 flags, guint retries)
+{
+	struct in_flight *entry;
+
+	if (send_chunk_header(client, chnk, flags) != 0 ||
+	    send_data(client->output_stream, chnk->data, chnk->size,
+	              "Error writing chunk data") != 0) {
 		return -1;
 	}
 
-	g_debug("Sent chunk size: %d", chnk->size);
+	entry = g_new0(struct in_flight, 1);
+	entry->chnk = chunk_ref(chnk);
+	entry->retries = retries;
+	g_queue_push_tail(client->in_flight, entry);
 
-	// Send chunk hash
-	if (send_data(output_stream, &chnk->hash, sizeof(chnk->hash),
-	              "Error writing chunk hash") != 0) {
+	return 0;
+}
+
+/* Read the verdict on the oldest chunk in flight */
+static gint client_drain_one(struct cs_client *client)
+{
+	struct in_flight *entry = g_queue_pop_head(client->in_flight);
+	struct chunk *chnk = entry->chnk;
+	enum QCResponse resp = wait_and_get_response(client->input_stream);
+	gint ret = 0;
+
+	if (!chnk) {
+		if (resp != QC_RESPONSE_ACK) {
+			g_critical("Protocol error: flush not acknowledged");
+			ret = -1;
+		}
+	} else if (resp == QC_RESPONSE_EQL) {
+		g_debug("Chunk %" G_GINT64_FORMAT " was equal, speculative data wasted",
+		        chnk->num);
+		client->spec_wasted_bytes += chnk->size;
+		client_chunk_done(client, chnk, QC_CHANGE_EQUAL);
+	} else if (resp == QC_RESPONSE_ACK || resp == QC_RESPONSE_RTY) {
+		if (!entry->retries) {
+			client->spec_dirty++;
+		}
+
+		if (resp == QC_RESPONSE_ACK) {
+			client_chunk_done(client, chnk, QC_CHANGE_DIRTY);
+		} else if (entry->retries >= QC_MAX_RETRIES) {
+			g_critical("Chunk %" G_GINT64_FORMAT " still damaged after %u retries",
+			           chnk->num, entry->retries);
+			ret = -1;
+		} else {
+			g_warning("Chunk %" G_GINT64_FORMAT " arrived damaged, sending it again",
+			          chnk->num);
+			client->spec_resent++;
+			ret = send_speculative(client, chnk, QC_CHUNK_RESEND, entry->retries + 1);
+		}
+	} else {
+		g_critical("Protocol error: unexpected verdict on chunk %" G_GINT64_FORMAT,
+		           chnk->num);
+		ret = -1;
+	}
+
+	if (chnk) {
+		chunk_unref(chnk);
+	}
+
+	g_free(entry);
+
+	return ret;
+}
+
+/*
+ * Let the server decide on all chunks in flight. The server waits for the
+ * next record before it decides on chunks below the budget, so ask for it.
+ * Data sent again while draining is flushed by the next round.
+ */
+static gint client_flush(struct cs_client *client)
+{
+	gint64 num = 0;
+
+	while (!g_queue_is_empty(client->in_flight)) {
+		if (send_data(client->output_stream, &num, sizeof(num),
+		              "Error writing flush") != 0) {
+			return -1;
+		}
+
+		g_queue_push_tail(client->in_flight, g_new0(struct in_flight, 1));
+
+		while (((struct in_flight *) g_queue_peek_head(client->in_flight))->chnk) {
+			if (client_drain_one(client) != 0) {
+				return -1;
+			}
+		}
+
+		if (client_drain_one(client) != 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send a chunk that is predicted dirty together with its data, without waiting
+ * for the verdict. Its verdict is read once the in-flight budget is used up,
+ * or on the next flush.
+ */
+static gint client_speculate(struct cs_client *client, struct chunk *chnk)
+{
+	if (!chnk->data && client_reread_chunk(client, chnk) != 0) {
+		return -1;
+	}
+
+	while (g_queue_get_length(client->in_flight) >= client->spec_budget) {
+		if (client_drain_one(client) != 0) {
+			return -1;
+		}
+	}
+
+	client->spec_sent++;
+
+	return send_speculative(client, chnk, QC_CHUNK_SPECULATIVE, 0);
+}
+
+void client_report_speculation(struct cs_client *client)
+{
+	g_message("%s: sent %" G_GUINT64_FORMAT " chunks ahead of their verdict, %"
+	          G_GUINT64_FORMAT " of them dirty (%.1f%% accurate), %.0f MB wasted on equal ones",
+	          client->name, client->spec_sent, client->spec_dirty,
+	          client->spec_sent ? 100.0 * client->spec_dirty / client->spec_sent : 0,
+	          client->spec_wasted_bytes / (1024.0 * 1024));
+
+	g_message("%s: %" G_GUINT64_FORMAT " dirty chunks were not predicted, %"
+	          G_GUINT64_FORMAT " speculative chunks arrived damaged",
+	          client->name, client->spec_missed, client->spec_resent);
+}
+
+gint client_check_and_upload(struct cs_client *client, struct chunk *chnk)
+{
+	GInputStream *input_stream = client->input_stream;
+	GOutputStream *output_stream = client->output_stream;
+	enum QCChange state = QC_CHANGE_DIRTY;
+	enum QCResponse resp;
+
+	/* Verdicts arrive in order, the ones in flight come first */
+	if (client->in_flight && client_flush(client) != 0) {
 		return -1;
 	}
 
-	g_debug("Sent chunk hash: 0x%lx%lx", chnk->hash.high64, chnk->hash.low64);
+	if (send_chunk_header(client, chnk, 0) != 0) {
+		return -1;
+	}
 
 	// Wait for response
 	resp = wait_and_get_response(input_stream);
@@ -152,7 +545,17 @@ gint client_check_and_upload(struct cs_data *cs, struct chunk *chnk)
 		return -1;
 	} else if (resp == QC_RESPONSE_EQL) {
 		g_debug("Hash equal, do not send chunk data");
+		state = QC_CHANGE_EQUAL;
+	} else if (resp == QC_RESPONSE_CPY) {
+		g_debug("Server has the data at another offset, do not send chunk data");
+		state = QC_CHANGE_COPIED;
+	} else if (resp == QC_RESPONSE_ACK && client->plan) {
+		g_info("%s: chunk %" G_GINT64_FORMAT " differs", client->name, chnk->num);
 	} else if (resp == QC_RESPONSE_ACK) {
+		if (!chnk->data && client_reread_chunk(client, chnk) != 0) {
+			return -1;
+		}
+
 		// Send the chunk data
 		gint64 start_time = g_get_monotonic_time();
 
@@ -169,22 +572,43 @@ gint client_check_and_upload(struct cs_data *cs, struct chunk *chnk)
 		       chnk->size, elapsed_microseconds / 1e6, throughput);
 	}
 
-	// Wait for ACK
+	// Wait for ACK, the server asks again for data that arrived damaged
 	resp = wait_and_get_response(input_stream);
 
-	if (resp != QC_RESPONSE_ACK) {
+	while (resp == QC_RESPONSE_RTY) {
+		g_warning("Chunk %" G_GINT64_FORMAT " arrived damaged, sending it again",
+		          chnk->num);
+
+		if (send_data(output_stream, chnk->data, chnk->size,
+		              "Error writing chunk data") != 0) {
+			return -1;
+		}
+
+		resp = wait_and_get_response(input_stream);
+	}
+
+	if (resp == QC_RESPONSE_NOK) {
+		g_critical("%s: chunk %" G_GINT64_FORMAT " still damaged on the server, it gave up",
+		           client->name, chnk->num);
+		return -1;
+	} else if (resp != QC_RESPONSE_ACK) {
 		g_critical("Protocol error!");
 		return -1;
 	}
 
+	if (client->in_flight && state != QC_CHANGE_EQUAL) {
+		client->spec_missed++;
+	}
+
+	client_chunk_done(client, chnk, state);
+
 	return 0;
 }
 
-gint client_send_exit(struct cs_data *cs)
+gint client_send_exit(struct cs_client *client)
 {
-	gsize bytes_written, bytes_read;
-	GInputStream *input_stream = cs->client->input_stream;
-	GOutputStream *output_stream = cs->client->output_stream;
+	gsize bytes_written;
+	GOutputStream *output_stream = client->output_stream;
 	GError *error = NULL;
 	gint64 num = -1;
 
@@ -198,3 +622,62 @@ gint client_send_exit(struct cs_data *cs)
 
 	return 0;
 }
+
+gint client_begin(struct cs_client *client)
+{
+	switch (client->kind) {
+	case QC_DEST_PATCH:
+		return patch_begin(client);
+
+	case QC_DEST_MANIFEST:
+		return manifest_begin(client);
+
+	default:
+		init_client(client);
+
+		if (client_send_session_header(client)) {
+			return -1;
+		}
+
+		return client->plan ? plan_send_probe(client) : 0;
+	}
+}
+
+gint client_handle_chunk(struct cs_client *client, struct chunk *chnk)
+{
+	switch (client->kind) {
+	case QC_DEST_PATCH:
+		return patch_add_chunk(client, chnk);
+
+	case QC_DEST_MANIFEST:
+		return manifest_add_chunk(client, chnk);
+
+	default:
+		if (client->in_flight &&
+		    history_predicts_dirty(client->history, chnk->num)) {
+			return client_speculate(client, chnk);
+		}
+
+		return client_check_and_upload(client, chnk);
+	}
+}
+
+gint client_end(struct cs_client *client)
+{
+	switch (client->kind) {
+	case QC_DEST_PATCH:
+		return patch_end(client);
+
+	case QC_DEST_MANIFEST:
+		return manifest_end(client);
+
+	default:
+		if (client->in_flight && client_flush(client) != 0) {
+			return -1;
+		}
+
+		client_send_exit(client);
+
+		return client->plan ? plan_receive_rates(client) : 0;
+	}
+}
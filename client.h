@@ -8,9 +8,21 @@
 
 #include "quickchunk.h"
 
-gint init_client(struct cs_data *cs);
-gint client_check_and_upload(struct cs_data *cs, struct chunk *chnk);
-gint client_send_exit(struct cs_data *cs);
-gint deinit_client(struct cs_data *cs);
+struct cs_client *client_new(struct cs_data *cs, const gchar *destination);
+struct cs_client *client_new_file(struct cs_data *cs, enum QCDestination kind,
+                                  const gchar *filename);
+void client_free(struct cs_client *client);
+gint client_begin(struct cs_client *client);
+gint client_handle_chunk(struct cs_client *client, struct chunk *chnk);
+gint client_end(struct cs_client *client);
+gint client_reread_chunk(struct cs_client *client, struct chunk *chnk);
+gint init_client(struct cs_client *client);
+gint send_data(GOutputStream *output_stream, gpointer data, gsize size,
+               const gchar *error_msg);
+gint client_send_session_header(struct cs_client *client);
+gint client_check_and_upload(struct cs_client *client, struct chunk *chnk);
+gint client_send_exit(struct cs_client *client);
+void client_report_speculation(struct cs_client *client);
+gint deinit_client(struct cs_client *client);
 
 #endif //QUICKCHUNK_CLIENT_H
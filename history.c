@@ -0,0 +1,131 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "history.h"
+
+/* A missing history file starts out empty, nothing is predicted yet */
+struct history *history_load(struct cs_data *cs, const gchar *filename)
+{
+	struct history *history;
+	gchar magic[sizeof(QC_HISTORY_MAGIC) - 1];
+	guint64 chunk_size, filesize, chunk_count;
+	FILE *fp;
+
+	history = g_new0(struct history, 1);
+	history->chunk_count = cs->chunk_count;
+	history->filesize = cs->filesize;
+	history->entries = g_new0(struct history_entry, cs->chunk_count);
+
+	fp = g_fopen(filename, "r");
+
+	if (!fp) {
+		g_message("No history in %s yet, starting a new one", filename);
+		return history;
+	}
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, QC_HISTORY_MAGIC, sizeof(magic)) != 0 ||
+	    fread_le64(fp, &chunk_size) || fread_le64(fp, &filesize) ||
+	    fread_le64(fp, &chunk_count)) {
+		g_critical("%s is no history", filename);
+		goto err;
+	}
+
+	if (chunk_size != QC_CHUNK_SIZE || filesize != cs->filesize ||
+	    chunk_count != cs->chunk_count) {
+		g_critical("History %s belongs to a file of different size", filename);
+		goto err;
+	}
+
+	for (guint64 i = 0; i < chunk_count; i++) {
+		guint32 entry[2];
+
+		if (fread(entry, sizeof(entry), 1, fp) != 1) {
+			g_critical("History %s is truncated", filename);
+			goto err;
+		}
+
+		history->entries[i].dirty_bits = GUINT32_FROM_LE(entry[0]);
+		history->entries[i].sessions = GUINT32_FROM_LE(entry[1]);
+	}
+
+	fclose(fp);
+
+	return history;
+
+err:
+	fclose(fp);
+	history_free(history);
+
+	return NULL;
+}
+
+/*
+ * A chunk is predicted dirty if it was dirty in at least 7 of its last 8
+ * sessions, or in all of them if it has only been compared 4 to 7 times.
+ */
+gboolean history_predicts_dirty(struct history *history, gint64 num)
+{
+	struct history_entry *entry = &history->entries[num - 1];
+	guint depth = MIN(entry->sessions, QC_HISTORY_DEPTH);
+	guint dirty;
+
+	if (depth < QC_HISTORY_MIN) {
+		return FALSE;
+	}
+
+	dirty = __builtin_popcount(entry->dirty_bits & ((1U << depth) - 1));
+
+	return dirty * 8 >= depth * 7;
+}
+
+void history_record(struct history *history, gint64 num, gboolean dirty)
+{
+	struct history_entry *entry = &history->entries[num - 1];
+
+	entry->dirty_bits = (entry->dirty_bits << 1) | !!dirty;
+	entry->sessions = MIN(entry->sessions + 1, 32);
+}
+
+static gint history_write(FILE *fp, gpointer data)
+{
+	struct history *history = data;
+
+	if (fwrite(QC_HISTORY_MAGIC, strlen(QC_HISTORY_MAGIC), 1, fp) != 1 ||
+	    fwrite_le64(fp, QC_CHUNK_SIZE) ||
+	    fwrite_le64(fp, history->filesize) ||
+	    fwrite_le64(fp, history->chunk_count)) {
+		return -1;
+	}
+
+	for (guint64 i = 0; i < history->chunk_count; i++) {
+		guint32 entry[2] = {
+			GUINT32_TO_LE(history->entries[i].dirty_bits),
+			GUINT32_TO_LE(history->entries[i].sessions)
+		};
+
+		if (fwrite(entry, sizeof(entry), 1, fp) != 1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Like the rolling state, a crash must not leave a half written history */
+gint history_save(struct history *history, const gchar *filename)
+{
+	return save_atomically(filename, "history", history_write, history);
+}
+
+void history_free(struct history *history)
+{
+	if (!history) {
+		return;
+	}
+
+	g_free(history->entries);
+	g_free(history);
+}
@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_HISTORY_H
+#define QUICKCHUNK_HISTORY_H
+
+#include "quickchunk.h"
+
+/*
+ * Change history of a file towards one destination, kept across sessions, all
+ * integers little endian:
+ *
+ *   8 bytes   magic "QCHIST01"
+ *   8 bytes   chunk size
+ *   8 bytes   file size
+ *   8 bytes   number of chunks
+ *
+ * followed by one 8 byte record per chunk
+ *
+ *   4 bytes   one bit per session the chunk was compared in, bit 0 for the
+ *             latest, set if it was dirty
+ *   4 bytes   number of sessions it was compared in, at most 32
+ */
+#define QC_HISTORY_MAGIC        "QCHIST01"
+#define QC_HISTORY_DEPTH        8	/* sessions a prediction looks at */
+#define QC_HISTORY_MIN          4	/* sessions needed for a prediction */
+
+struct history_entry {
+	guint32 dirty_bits;
+	guint32 sessions;
+};
+
+struct history {
+	guint64 chunk_count;
+	gsize filesize;
+	struct history_entry *entries;
+};
+
+struct history *history_load(struct cs_data *cs, const gchar *filename);
+gboolean history_predicts_dirty(struct history *history, gint64 num);
+void history_record(struct history *history, gint64 num, gboolean dirty);
+gint history_save(struct history *history, const gchar *filename);
+void history_free(struct history *history);
+
+#endif //QUICKCHUNK_HISTORY_H
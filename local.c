@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include <sys/stat.h>
+
+#include "local.h"
+#include "bitmap.h"
+#include "changemap.h"
+
+struct local_side {
+	struct cs_data *cs;
+	const gchar *filename;
+	GAsyncQueue *queue;
+	gboolean is_source;
+};
+
+/* Hash one file chunk by chunk, source and target run in parallel */
+static void *local_hash_thr(void *data)
+{
+	struct local_side *side = (struct local_side *) data;
+	struct cs_data *cs = side->cs;
+	struct chunk *chnk;
+	GArray *extents;
+	gchar *buf;
+	FILE *fp;
+
+	fp = g_fopen(side->filename, "r");
+
+	if (!fp) {
+		g_error("Unable to open file <%s>: %s", __func__, side->filename);
+	}
+
+	buf = g_malloc(QC_CHUNK_SIZE);
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		off_t offset = (off_t)(num - 1) * QC_CHUNK_SIZE;
+		gsize size = MIN(QC_CHUNK_SIZE, cs->filesize - offset);
+
+		if (!chunk_is_selected(cs, num)) {
+			if (side->is_source) {
+				cs->current_file_position += size;
+			}
+
+			continue;
+		}
+
+		while (g_async_queue_length(side->queue) >= QC_MAX_READER_QUEUE) {
+			g_usleep(QC_WAIT_TIME);
+		}
+
+		chnk = g_new0(struct chunk, 1);
+		chnk->num = num;
+		extents = chunk_extents(cs, num, &chnk->partial);
+		chnk->size = extents_size(extents);
+
+		if (read_extents(fp, extents, buf)) {
+			g_error("Failed to read chunk %" G_GUINT64_FORMAT " of %s", num,
+			        side->filename);
+		}
+
+		g_array_free(extents, TRUE);
+		chnk->hash = get_hash128(buf, chnk->size);
+		g_async_queue_push(side->queue, chnk);
+
+		if (side->is_source) {
+			cs->current_file_position += size;
+		}
+	}
+
+	g_free(buf);
+	fclose(fp);
+
+	return NULL;
+}
+
+/*
+ * Chunks do not start at block boundaries, which keeps a copy-on-write
+ * filesystem from sharing the extents of a copy that spans them. Copy the
+ * unaligned head and tail separately from the aligned middle instead. The
+ * copy must not reach into a neighbouring chunk: that one may not have been
+ * hashed yet and would then compare as equal.
+ */
+static gint copy_chunk_aligned(gint src_fd, gint dst_fd, off_t offset, gsize size,
+                               off_t block_size)
+{
+	off_t end = offset + (off_t) size;
+	off_t head = MIN((offset + block_size - 1) / block_size * block_size, end);
+	off_t tail = MAX(end / block_size * block_size, head);
+
+	if ((head > offset && copy_range(src_fd, offset, dst_fd, offset, head - offset)) ||
+	    (tail > head && copy_range(src_fd, head, dst_fd, head, tail - head)) ||
+	    (end > tail && copy_range(src_fd, tail, dst_fd, tail, end - tail))) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Sync the file to a target on the same host: both files are hashed
+ * concurrently and differing chunks are copied in the kernel, so no data
+ * passes through a socket or our own buffers.
+ */
+gint sync_local(struct cs_data *cs, const gchar *target)
+{
+	struct local_side src = { cs, cs->filename, NULL, TRUE };
+	struct local_side dst = { cs, target, NULL, FALSE };
+	GThread *src_thread, *dst_thread;
+	guint64 chunks_copied = 0, chunks_equal = 0;
+	gsize bytes_copied = 0;
+	struct change_map *map = NULL;
+	gint64 start_time = g_get_monotonic_time();
+	gint src_fd, dst_fd;
+	off_t target_size, block_size;
+	struct stat st;
+	gint ret = -1;
+
+	src_fd = open(cs->filename, O_RDONLY);
+	dst_fd = open(target, O_RDWR | O_CREAT, 0644);
+
+	if (src_fd < 0 || dst_fd < 0) {
+		g_critical("Unable to open %s or %s: %s", cs->filename, target,
+		           g_strerror(errno));
+		goto out;
+	}
+
+	target_size = lseek(dst_fd, 0, SEEK_END);
+
+	if (target_size == 0 && cs->filesize) {
+		g_message("Target %s is empty, creating it with %" G_GSIZE_FORMAT " bytes",
+		          target, cs->filesize);
+
+		if (ftruncate(dst_fd, cs->filesize)) {
+			g_critical("Unable to resize %s: %s", target, g_strerror(errno));
+			goto out;
+		}
+	} else if (target_size != (off_t) cs->filesize) {
+		g_critical("not yet supported: target size (%" G_GINT64_FORMAT
+		           ") differs from file size (%" G_GSIZE_FORMAT ")",
+		           (gint64) target_size, cs->filesize);
+		goto out;
+	}
+
+	block_size = fstat(dst_fd, &st) == 0 && st.st_blksize > 0 ? st.st_blksize : 1;
+	ret = 0;
+
+	if (cs->change_map) {
+		map = changemap_new(cs);
+	}
+
+	src.queue = g_async_queue_new();
+	dst.queue = g_async_queue_new();
+	src_thread = g_thread_new("source hash thread", &local_hash_thr, &src);
+	dst_thread = g_thread_new("target hash thread", &local_hash_thr, &dst);
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		struct chunk *src_chnk, *dst_chnk;
+
+		if (!chunk_is_selected(cs, num)) {
+			continue;
+		}
+
+		src_chnk = g_async_queue_pop(src.queue);
+		dst_chnk = g_async_queue_pop(dst.queue);
+
+		if (are_hashes_equal(src_chnk->hash, dst_chnk->hash)) {
+			chunks_equal++;
+
+			if (map) {
+				changemap_set(map, src_chnk, QC_CHANGE_EQUAL);
+			}
+		} else if (!ret && src_chnk->partial) {
+			/* Only the dirty extents were compared, copy just these */
+			GArray *extents = chunk_extents(cs, num, &src_chnk->partial);
+
+			g_debug("Chunk %" G_GUINT64_FORMAT " differs, copying its dirty blocks", num);
+
+			for (guint i = 0; i < extents->len && !ret; i++) {
+				struct extent *ext = &g_array_index(extents, struct extent, i);
+
+				if (copy_range(src_fd, ext->offset, dst_fd, ext->offset, ext->size) != 0) {
+					g_critical("Failed to copy chunk %" G_GUINT64_FORMAT ": %s", num,
+					           g_strerror(errno));
+					ret = -1;
+				}
+			}
+
+			chunks_copied++;
+			bytes_copied += src_chnk->size;
+			g_array_free(extents, TRUE);
+
+			if (map) {
+				changemap_set(map, src_chnk, QC_CHANGE_DIRTY);
+			}
+		} else if (!ret) {
+			off_t offset = (off_t)(num - 1) * QC_CHUNK_SIZE;
+
+			g_debug("Chunk %" G_GUINT64_FORMAT " differs, copying", num);
+
+			if (copy_chunk_aligned(src_fd, dst_fd, offset, src_chnk->size,
+			                       block_size) != 0) {
+				g_critical("Failed to copy chunk %" G_GUINT64_FORMAT ": %s", num,
+				           g_strerror(errno));
+				ret = -1;
+			}
+
+			chunks_copied++;
+			bytes_copied += src_chnk->size;
+
+			if (map) {
+				changemap_set(map, src_chnk, QC_CHANGE_DIRTY);
+			}
+		}
+
+		g_free(src_chnk);
+		g_free(dst_chnk);
+	}
+
+	g_thread_join(src_thread);
+	g_thread_join(dst_thread);
+	g_async_queue_unref(src.queue);
+	g_async_queue_unref(dst.queue);
+
+	if (!ret && fsync(dst_fd)) {
+		g_critical("Failed to sync %s: %s", target, g_strerror(errno));
+		ret = -1;
+	}
+
+	if (map) {
+		if (!ret) {
+			ret = changemap_save(map, cs->change_map);
+		}
+
+		changemap_free(map);
+	}
+
+	if (!ret) {
+		g_message("Local sync done in %.2lf seconds: %" G_GUINT64_FORMAT
+		          " chunks equal, %" G_GUINT64_FORMAT " chunks (%" G_GSIZE_FORMAT
+		          " bytes) copied", (g_get_monotonic_time() - start_time) / 1e6,
+		          chunks_equal, chunks_copied, bytes_copied);
+	}
+
+out:
+	if (src_fd >= 0) {
+		close(src_fd);
+	}
+
+	if (dst_fd >= 0) {
+		close(dst_fd);
+	}
+
+	return ret;
+}
@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_LOCAL_H
+#define QUICKCHUNK_LOCAL_H
+
+#include "quickchunk.h"
+
+gint sync_local(struct cs_data *cs, const gchar *target);
+
+#endif //QUICKCHUNK_LOCAL_H
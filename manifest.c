@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "manifest.h"
+
+struct manifest *manifest_load(const gchar *filename)
+{
+	struct manifest *manifest;
+	gchar magic[sizeof(QC_MANIFEST_MAGIC) - 1];
+	FILE *fp;
+
+	fp = g_fopen(filename, "r");
+
+	if (!fp) {
+		g_critical("Unable to open manifest %s", filename);
+		return NULL;
+	}
+
+	manifest = g_new0(struct manifest, 1);
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, QC_MANIFEST_MAGIC, sizeof(magic)) != 0 ||
+	    fread_le64(fp, &manifest->chunk_size) ||
+	    fread_le64(fp, &manifest->filesize) ||
+	    fread_le64(fp, &manifest->chunk_count)) {
+		g_critical("%s is no manifest", filename);
+		goto err;
+	}
+
+	if (manifest->chunk_size != QC_CHUNK_SIZE) {
+		g_critical("Manifest chunk size %" G_GUINT64_FORMAT " differs from %lu",
+		           manifest->chunk_size, QC_CHUNK_SIZE);
+		goto err;
+	}
+
+	if (manifest->chunk_count != (manifest->filesize + QC_CHUNK_SIZE - 1) /
+	    QC_CHUNK_SIZE) {
+		g_critical("Manifest chunk count does not match its file size");
+		goto err;
+	}
+
+	manifest->hashes = g_new0(XXH128_hash_t, manifest->chunk_count);
+
+	for (guint64 i = 0; i < manifest->chunk_count; i++) {
+		if (fread_hash128(fp, &manifest->hashes[i])) {
+			g_critical("Manifest %s is truncated", filename);
+			goto err;
+		}
+	}
+
+	fclose(fp);
+
+	return manifest;
+
+err:
+	fclose(fp);
+	manifest_free(manifest);
+
+	return NULL;
+}
+
+/* Hash every chunk of an open file, as a manifest export of it would */
+struct manifest *manifest_of_file(struct cs_data *cs, FILE *fp)
+{
+	struct manifest *manifest = g_new0(struct manifest, 1);
+	gchar *buf = g_malloc(QC_CHUNK_SIZE);
+
+	manifest->chunk_size = QC_CHUNK_SIZE;
+	manifest->filesize = cs->filesize;
+	manifest->chunk_count = cs->chunk_count;
+	manifest->hashes = g_new0(XXH128_hash_t, cs->chunk_count);
+
+	for (guint64 i = 0; i < manifest->chunk_count; i++) {
+		gsize size = MIN(QC_CHUNK_SIZE, cs->filesize - i * QC_CHUNK_SIZE);
+
+		if (fseeko(fp, (off_t) i * QC_CHUNK_SIZE, SEEK_SET) ||
+		    fread(buf, 1, size, fp) != size) {
+			g_critical("Failed to read chunk %" G_GUINT64_FORMAT " of %s", i + 1,
+			           cs->filename);
+			g_free(buf);
+			manifest_free(manifest);
+			return NULL;
+		}
+
+		manifest->hashes[i] = get_hash128(buf, size);
+	}
+
+	g_free(buf);
+
+	return manifest;
+}
+
+/* Identifies the content a manifest describes, over its hashes as stored */
+XXH128_hash_t manifest_digest(struct manifest *manifest)
+{
+	guint64 *buf = g_new(guint64, 2 * manifest->chunk_count);
+	XXH128_hash_t digest;
+
+	for (guint64 i = 0; i < manifest->chunk_count; i++) {
+		buf[2 * i] = GUINT64_TO_LE(manifest->hashes[i].low64);
+		buf[2 * i + 1] = GUINT64_TO_LE(manifest->hashes[i].high64);
+	}
+
+	digest = get_hash128(buf, 2 * sizeof(*buf) * manifest->chunk_count);
+	g_free(buf);
+
+	return digest;
+}
+
+void manifest_free(struct manifest *manifest)
+{
+	if (!manifest) {
+		return;
+	}
+
+	g_free(manifest->hashes);
+	g_free(manifest);
+}
+
+gint manifest_begin(struct cs_client *client)
+{
+	struct cs_data *cs = client->cs;
+
+	client->manifest = g_new0(struct manifest, 1);
+	client->manifest->chunk_size = QC_CHUNK_SIZE;
+	client->manifest->filesize = cs->filesize;
+	client->manifest->chunk_count = cs->chunk_count;
+	client->manifest->hashes = g_new0(XXH128_hash_t, cs->chunk_count);
+
+	return 0;
+}
+
+gint manifest_add_chunk(struct cs_client *client, struct chunk *chnk)
+{
+	client->manifest->hashes[chnk->num - 1] = chnk->hash;
+	client->chunks_written++;
+
+	return 0;
+}
+
+gint manifest_end(struct cs_client *client)
+{
+	struct manifest *manifest = client->manifest;
+	FILE *fp;
+	gint ret = 0;
+
+	if (client->chunks_written != manifest->chunk_count) {
+		g_critical("Manifest needs all %" G_GUINT64_FORMAT " chunks, got %"
+		           G_GUINT64_FORMAT, manifest->chunk_count, client->chunks_written);
+		return -1;
+	}
+
+	fp = g_fopen(client->name, "w");
+
+	if (!fp) {
+		g_critical("Unable to create manifest %s", client->name);
+		return -1;
+	}
+
+	if (fwrite(QC_MANIFEST_MAGIC, strlen(QC_MANIFEST_MAGIC), 1, fp) != 1 ||
+	    fwrite_le64(fp, manifest->chunk_size) ||
+	    fwrite_le64(fp, manifest->filesize) ||
+	    fwrite_le64(fp, manifest->chunk_count)) {
+		ret = -1;
+	}
+
+	for (guint64 i = 0; !ret && i < manifest->chunk_count; i++) {
+		ret = fwrite_hash128(fp, manifest->hashes[i]);
+	}
+
+	if (fclose(fp) || ret) {
+		g_critical("Failed to write manifest %s", client->name);
+		return -1;
+	}
+
+	g_message("Wrote manifest of %" G_GUINT64_FORMAT " chunks to %s",
+	          manifest->chunk_count, client->name);
+
+	manifest_free(client->manifest);
+	client->manifest = NULL;
+
+	return 0;
+}
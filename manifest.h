@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_MANIFEST_H
+#define QUICKCHUNK_MANIFEST_H
+
+#include "quickchunk.h"
+
+/*
+ * Manifest file, all integers little endian:
+ *
+ *   8 bytes        magic "QCMANIF1"
+ *   8 bytes        chunk size
+ *   8 bytes        file size
+ *   8 bytes        number of chunks
+ *   16 bytes each  XXH3-128 hash (low64, high64) of every chunk
+ */
+#define QC_MANIFEST_MAGIC       "QCMANIF1"
+
+struct manifest {
+	guint64 chunk_size;
+	guint64 filesize;
+	guint64 chunk_count;
+	XXH128_hash_t *hashes;	/* hash of chunk num at index num - 1 */
+};
+
+struct manifest *manifest_load(const gchar *filename);
+struct manifest *manifest_of_file(struct cs_data *cs, FILE *fp);
+XXH128_hash_t manifest_digest(struct manifest *manifest);
+void manifest_free(struct manifest *manifest);
+gint manifest_begin(struct cs_client *client);
+gint manifest_add_chunk(struct cs_client *client, struct chunk *chnk);
+gint manifest_end(struct cs_client *client);
+
+#endif //QUICKCHUNK_MANIFEST_H
@@ -0,0 +1,704 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+/*
+ * quickchunk-mini: a small, statically linked build for initramfs use. It
+ * speaks the same wire protocol and takes the same basic options as
+ * quickchunk, but only needs libc, POSIX threads and xxHash (inlined).
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <xxhash.h>
+
+#include "protocol.h"
+
+#define QC_IO_BLOCK_SIZE        (4 * 1024 * 1024UL)
+
+/* Keep memory low, every queued chunk of the client holds its data */
+#define MINI_MAX_READER_QUEUE   1
+
+struct chunk {
+	int64_t num;
+	XXH128_hash_t hash;
+	size_t size;
+	char *data;
+};
+
+struct mini_queue {
+	struct chunk *items[MINI_MAX_READER_QUEUE];
+	unsigned int head, len;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+};
+
+struct mini_data {
+	int is_server;
+	int full_scan;
+	int verify;
+	const char *server_ip;
+	unsigned int server_port;
+	const char *filename;
+	const char *dirty_bitmap;
+	int fd;
+	uint64_t filesize;
+	uint64_t chunk_count;
+	uint8_t *chunk_mask;
+	struct mini_queue queue;
+};
+
+static int verbosity;
+
+static void mini_log(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (level > verbosity) {
+		return;
+	}
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+}
+
+static void __attribute__((noreturn)) mini_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fputs("ERROR: ", stderr);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+
+	exit(EXIT_FAILURE);
+}
+
+#define mini_message(...)  mini_log(0, __VA_ARGS__)
+#define mini_info(...)     mini_log(1, __VA_ARGS__)
+#define mini_debug(...)    mini_log(2, __VA_ARGS__)
+
+static int are_hashes_equal(XXH128_hash_t hash1, XXH128_hash_t hash2)
+{
+	return (hash1.low64 == hash2.low64) && (hash1.high64 == hash2.high64);
+}
+
+static int chunk_is_selected(struct mini_data *md, int64_t num)
+{
+	return (md->chunk_mask[(num - 1) / 8] >> ((num - 1) % 8)) & 1;
+}
+
+static size_t chunk_size(struct mini_data *md, int64_t num)
+{
+	uint64_t offset = (num - 1) * QC_CHUNK_SIZE;
+
+	return md->filesize - offset < QC_CHUNK_SIZE ? md->filesize - offset :
+	       QC_CHUNK_SIZE;
+}
+
+static void queue_push(struct mini_queue *q, struct chunk *chnk)
+{
+	pthread_mutex_lock(&q->mutex);
+
+	while (q->len == MINI_MAX_READER_QUEUE) {
+		pthread_cond_wait(&q->cond, &q->mutex);
+	}
+
+	q->items[(q->head + q->len) % MINI_MAX_READER_QUEUE] = chnk;
+	q->len++;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+}
+
+static struct chunk *queue_pop(struct mini_queue *q)
+{
+	struct chunk *chnk;
+
+	pthread_mutex_lock(&q->mutex);
+
+	while (!q->len) {
+		pthread_cond_wait(&q->cond, &q->mutex);
+	}
+
+	chnk = q->items[q->head];
+	q->head = (q->head + 1) % MINI_MAX_READER_QUEUE;
+	q->len--;
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->mutex);
+
+	return chnk;
+}
+
+static void read_all(int fd, void *buf, size_t len, const char *what)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			mini_error("Error reading %s: %s", what, n ? strerror(errno) :
+			           "connection closed");
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+static void write_all(int fd, const void *buf, size_t len, const char *what)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, p, len);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			mini_error("Error writing %s: %s", what, strerror(errno));
+		}
+
+		p += n;
+		len -= n;
+	}
+}
+
+static void read_message(int fd, char *msg)
+{
+	read_all(fd, msg, QC_MESSAGE_LEN, "response");
+	msg[QC_MESSAGE_LEN] = '\0';
+	mini_debug("GOT %s", msg);
+}
+
+static void pread_all(int fd, char *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pread(fd, buf, len, offset);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			mini_error("Failed to read at offset %lld: %s", (long long) offset,
+			           n ? strerror(errno) : "end of file");
+		}
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void pwrite_all(int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t n;
+
+	while (len) {
+		n = pwrite(fd, buf, len, offset);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (n <= 0) {
+			mini_error("Failed to write at offset %lld: %s", (long long) offset,
+			           strerror(errno));
+		}
+
+		buf += n;
+		offset += n;
+		len -= n;
+	}
+}
+
+static void load_dirty_bitmap(struct mini_data *md)
+{
+	uint64_t block_size, block_count;
+	uint8_t *contents;
+	long length;
+	FILE *fp;
+
+	fp = fopen(md->dirty_bitmap, "r");
+
+	if (!fp || fseek(fp, 0, SEEK_END) || (length = ftell(fp)) < 0 ||
+	    fseek(fp, 0, SEEK_SET)) {
+		mini_error("Unable to read dirty bitmap %s", md->dirty_bitmap);
+	}
+
+	contents = malloc(length ? length : 1);
+
+	if (!contents || fread(contents, 1, length, fp) != (size_t) length) {
+		mini_error("Unable to read dirty bitmap %s", md->dirty_bitmap);
+	}
+
+	fclose(fp);
+
+	switch (qc_bitmap_parse(contents, length, &block_size, &block_count)) {
+	case QC_BITMAP_OK:
+		break;
+	case QC_BITMAP_NO_BITMAP:
+		mini_error("%s is no dirty bitmap", md->dirty_bitmap);
+	default:
+		mini_error("Dirty bitmap %s is truncated or has an invalid block size or count",
+		           md->dirty_bitmap);
+	}
+
+	for (uint64_t num = 1; num <= md->chunk_count; num++) {
+		uint64_t start = (num - 1) * QC_CHUNK_SIZE;
+
+		if (!qc_bitmap_range_dirty(contents + QC_BITMAP_HEADER_SIZE, block_size,
+		                           block_count, start, start + chunk_size(md, num))) {
+			md->chunk_mask[(num - 1) / 8] &= ~(1 << ((num - 1) % 8));
+		}
+	}
+
+	free(contents);
+}
+
+static void *reader_thr(void *data)
+{
+	struct mini_data *md = data;
+	struct chunk *chnk;
+
+	for (uint64_t num = 1; num <= md->chunk_count; num++) {
+		if (!chunk_is_selected(md, num)) {
+			continue;
+		}
+
+		chnk = calloc(1, sizeof(*chnk));
+
+		if (!chnk) {
+			mini_error("Out of memory");
+		}
+
+		chnk->num = num;
+		chnk->size = chunk_size(md, num);
+		chnk->data = malloc(chnk->size);
+
+		if (!chnk->data) {
+			mini_error("Out of memory");
+		}
+
+		pread_all(md->fd, chnk->data, chnk->size, (off_t)(num - 1) * QC_CHUNK_SIZE);
+		chnk->hash = XXH3_128bits(chnk->data, chnk->size);
+		mini_debug("%s item:%" PRIu64 " size:%zu", __func__, num, chnk->size);
+
+		if (md->is_server) {
+			/* No need to keep the actual data in server mode */
+			free(chnk->data);
+			chnk->data = NULL;
+		}
+
+		queue_push(&md->queue, chnk);
+	}
+
+	return NULL;
+}
+
+/*
+ * Only numeric addresses are accepted: name resolution would pull in NSS,
+ * which does not work in a static binary.
+ */
+static socklen_t parse_address(struct mini_data *md, struct sockaddr_storage *ss)
+{
+	struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+	struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+	memset(ss, 0, sizeof(*ss));
+
+	if (inet_pton(AF_INET, md->server_ip, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(md->server_port);
+		return sizeof(*sin);
+	}
+
+	if (inet_pton(AF_INET6, md->server_ip, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(md->server_port);
+		return sizeof(*sin6);
+	}
+
+	mini_error("Invalid IP address: %s", md->server_ip);
+}
+
+static int connect_to_server(struct mini_data *md)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = parse_address(md, &ss);
+	int sock;
+
+	sock = socket(ss.ss_family, SOCK_STREAM, 0);
+
+	if (sock < 0 || connect(sock, (struct sockaddr *) &ss, len)) {
+		mini_error("Failed to connect to %s:%u: %s", md->server_ip, md->server_port,
+		           strerror(errno));
+	}
+
+	return sock;
+}
+
+static void run_client(struct mini_data *md)
+{
+	struct qc_preamble pre = {
+		.version = PROJECT_VERSION,
+		.filesize = md->filesize,
+		.chunk_count = md->chunk_count,
+	};
+	uint8_t preamble[QC_PREAMBLE_SIZE];
+	uint8_t record[QC_RECORD_SIZE];
+	struct qc_record rec = { 0 };
+	char msg[QC_MESSAGE_LEN + 1];
+	pthread_t reader;
+	struct chunk *chnk;
+	int64_t exit_num = -1;
+	uint64_t flags = 0;
+	int sock;
+
+	sock = connect_to_server(md);
+
+	qc_preamble_encode(preamble, &pre);
+	write_all(sock, preamble, sizeof(preamble), "session header");
+	write_all(sock, md->chunk_mask, QC_MASK_BYTES(md->chunk_count), "chunk mask");
+	write_all(sock, &flags, sizeof(flags), "session flags");
+
+	pthread_create(&reader, NULL, reader_thr, md);
+
+	for (uint64_t num = 1; num <= md->chunk_count; num++) {
+		if (!chunk_is_selected(md, num)) {
+			continue;
+		}
+
+		chnk = queue_pop(&md->queue);
+
+		/* Never speculative, every chunk waits for its verdict */
+		rec.size = chnk->size;
+		rec.hash_low64 = chnk->hash.low64;
+		rec.hash_high64 = chnk->hash.high64;
+		qc_record_encode(record, &rec);
+
+		write_all(sock, &chnk->num, sizeof(chnk->num), "chunk num");
+		write_all(sock, record, sizeof(record), "chunk header");
+
+		read_message(sock, msg);
+
+		if (strcmp(msg, QC_ACK_MESSAGE) == 0) {
+			do {
+				write_all(sock, chnk->data, chnk->size, "chunk data");
+				read_message(sock, msg);
+			} while (strcmp(msg, QC_RTY_MESSAGE) == 0);
+		} else if (strcmp(msg, QC_EQL_MESSAGE) == 0 ||
+		           strcmp(msg, QC_CPY_MESSAGE) == 0) {
+			read_message(sock, msg);
+		} else {
+			mini_error("Unknown msg received (%s) from server, aborting.", msg);
+		}
+
+		if (strcmp(msg, QC_ACK_MESSAGE) != 0) {
+			mini_error("Protocol error!");
+		}
+
+		mini_info("chunk %" PRId64 " done", chnk->num);
+		free(chnk->data);
+		free(chnk);
+	}
+
+	write_all(sock, &exit_num, sizeof(exit_num), "exit");
+	pthread_join(reader, NULL);
+	close(sock);
+}
+
+static int receive_chunk(struct mini_data *md, int sock, struct chunk *chnk,
+                         char *buf)
+{
+	off_t offset = (off_t)(chnk->num - 1) * QC_CHUNK_SIZE;
+	size_t remaining = chnk->size;
+	XXH3_state_t *state = XXH3_createState();
+
+	XXH3_128bits_reset(state);
+
+	while (remaining) {
+		size_t len = remaining < QC_IO_BLOCK_SIZE ? remaining : QC_IO_BLOCK_SIZE;
+
+		read_all(sock, buf, len, "chunk data");
+
+		if (md->verify) {
+			XXH3_128bits_update(state, buf, len);
+		}
+
+		pwrite_all(md->fd, buf, len, offset);
+		offset += len;
+		remaining -= len;
+	}
+
+	remaining = !md->verify || are_hashes_equal(XXH3_128bits_digest(state),
+	                chnk->hash);
+	XXH3_freeState(state);
+
+	return remaining;
+}
+
+static void run_server(struct mini_data *md)
+{
+	uint8_t preamble[QC_PREAMBLE_SIZE];
+	uint8_t record[QC_RECORD_SIZE];
+	struct qc_preamble pre;
+	struct qc_record rec;
+	struct sockaddr_storage ss;
+	socklen_t len = parse_address(md, &ss);
+	struct chunk chnk, *current;
+	uint64_t flags;
+	pthread_t reader;
+	char *buf;
+	int listener, sock, retries, one = 1;
+
+	listener = socket(ss.ss_family, SOCK_STREAM, 0);
+
+	if (listener < 0 ||
+	    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    bind(listener, (struct sockaddr *) &ss, len) || listen(listener, 1)) {
+		mini_error("Failed to listen on %s:%u: %s", md->server_ip, md->server_port,
+		           strerror(errno));
+	}
+
+	sock = accept(listener, NULL, NULL);
+
+	if (sock < 0) {
+		mini_error("Failed to accept: %s", strerror(errno));
+	}
+
+	read_all(sock, preamble, sizeof(preamble), "session header");
+	qc_preamble_decode(preamble, &pre);
+
+	if (strcmp(pre.version, PROJECT_VERSION) != 0) {
+		mini_error("Version mismatch: client version %s, server version %s",
+		           pre.version, PROJECT_VERSION);
+	}
+
+	if (pre.filesize != md->filesize || pre.chunk_count != md->chunk_count) {
+		mini_error("not yet supported: remote_filesize (%" PRIu64
+		           ") differ from local filesize (%" PRIu64 ")",
+		           pre.filesize, md->filesize);
+	}
+
+	read_all(sock, md->chunk_mask, QC_MASK_BYTES(md->chunk_count), "chunk mask");
+	read_all(sock, &flags, sizeof(flags), "session flags");
+
+	if (flags) {
+		mini_error("Session flags 0x%" PRIx64 " not supported, e.g. --time-budget",
+		           flags);
+	}
+
+	pthread_create(&reader, NULL, reader_thr, md);
+	buf = malloc(QC_IO_BLOCK_SIZE);
+
+	while (1) {
+		read_all(sock, &chnk.num, sizeof(chnk.num), "chunk num");
+
+		if (chnk.num < 0) {
+			mini_debug("Client sent negative num, means end of transmission");
+			break;
+		}
+
+		current = queue_pop(&md->queue);
+
+		if (chnk.num != current->num) {
+			mini_error("Sync issue: chnk->num (%" PRId64 ") is unequal to current_num %"
+			           PRId64, chnk.num, current->num);
+		}
+
+		read_all(sock, record, sizeof(record), "chunk header");
+		qc_record_decode(record, &rec);
+		chnk.size = rec.size;
+		chnk.hash.low64 = rec.hash_low64;
+		chnk.hash.high64 = rec.hash_high64;
+
+		if (rec.flags) {
+			mini_error("Chunk flags 0x%" PRIx64 " not supported, e.g. --speculate",
+			           rec.flags);
+		}
+
+		if (chnk.size != current->size) {
+			mini_error("chunk->size issue");
+		}
+
+		if (are_hashes_equal(current->hash, chnk.hash)) {
+			write_all(sock, QC_EQL_MESSAGE, QC_MESSAGE_LEN, "EQL");
+		} else {
+			write_all(sock, QC_ACK_MESSAGE, QC_MESSAGE_LEN, "ACK");
+
+			for (retries = 0; !receive_chunk(md, sock, &chnk, buf); retries++) {
+				if (retries >= QC_MAX_RETRIES) {
+					mini_error("Chunk %" PRId64 " still damaged after %d retries",
+					           chnk.num, retries);
+				}
+
+				write_all(sock, QC_RTY_MESSAGE, QC_MESSAGE_LEN, "RTY");
+			}
+
+			mini_info("Wrote chunk %" PRId64, chnk.num);
+		}
+
+		write_all(sock, QC_ACK_MESSAGE, QC_MESSAGE_LEN, "final chunk ACK");
+		free(current);
+	}
+
+	if (fsync(md->fd)) {
+		mini_error("Failed to sync %s: %s", md->filename, strerror(errno));
+	}
+
+	pthread_join(reader, NULL);
+	free(buf);
+	close(sock);
+	close(listener);
+}
+
+static void usage(const char *prog)
+{
+	printf("Usage:\n  %s [OPTION...]\n\n"
+	       "Version:\n  " PROJECT_VERSION "\n\n"
+	       "  -s, --server              Run in server mode\n"
+	       "  -i, --ip=IP               IP address to use\n"
+	       "  -p, --port=PORT           Port to use\n"
+	       "  -f, --file=FILE           File to use\n"
+	       "  -b, --dirty-bitmap=FILE   Client: only read chunks flagged as changed in this bitmap\n"
+	       "  --full-scan               Client: ignore --dirty-bitmap and read everything\n"
+	       "  --verify=MODE             Server: none or stream (default)\n"
+	       "  -v, --verbose             Increase verbosity\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option options[] = {
+		{ "server", no_argument, NULL, 's' },
+		{ "ip", required_argument, NULL, 'i' },
+		{ "port", required_argument, NULL, 'p' },
+		{ "file", required_argument, NULL, 'f' },
+		{ "dirty-bitmap", required_argument, NULL, 'b' },
+		{ "full-scan", no_argument, NULL, 'F' },
+		{ "verify", required_argument, NULL, 'V' },
+		{ "verbose", no_argument, NULL, 'v' },
+		{ "help", no_argument, NULL, 'h' },
+		{ NULL }
+	};
+	struct mini_data md = {
+		.server_ip = QC_DEFAULT_SERVER_IP,
+		.server_port = QC_DEFAULT_SERVER_PORT,
+		.verify = 1,
+		.queue = {
+			.mutex = PTHREAD_MUTEX_INITIALIZER,
+			.cond = PTHREAD_COND_INITIALIZER,
+		},
+	};
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "si:p:f:b:vh", options, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			md.is_server = 1;
+			break;
+
+		case 'i':
+			md.server_ip = optarg;
+			break;
+
+		case 'p':
+			md.server_port = atoi(optarg);
+			break;
+
+		case 'f':
+			md.filename = optarg;
+			break;
+
+		case 'b':
+			md.dirty_bitmap = optarg;
+			break;
+
+		case 'F':
+			md.full_scan = 1;
+			break;
+
+		case 'V':
+			if (strcmp(optarg, "none") == 0) {
+				md.verify = 0;
+			} else if (strcmp(optarg, "stream") != 0) {
+				mini_error("Unknown verify mode: %s", optarg);
+			}
+
+			break;
+
+		case 'v':
+			verbosity++;
+			break;
+
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!md.filename) {
+		mini_error("missing filename");
+	}
+
+	md.fd = open(md.filename, md.is_server ? O_RDWR : O_RDONLY);
+
+	if (md.fd < 0) {
+		mini_error("Unable to open file %s: %s", md.filename, strerror(errno));
+	}
+
+	/* Works for block devices as well, unlike stat() */
+	md.filesize = lseek(md.fd, 0, SEEK_END);
+	md.chunk_count = (md.filesize + QC_CHUNK_SIZE - 1) / QC_CHUNK_SIZE;
+	md.chunk_mask = malloc(QC_MASK_BYTES(md.chunk_count) + 1);
+	memset(md.chunk_mask, 0xff, QC_MASK_BYTES(md.chunk_count) + 1);
+
+	if (md.is_server) {
+		mini_message("NOTE: Selected file (%s) gets altered by client.", md.filename);
+		run_server(&md);
+	} else {
+		if (md.dirty_bitmap && !md.full_scan) {
+			load_dirty_bitmap(&md);
+		}
+
+		run_client(&md);
+	}
+
+	close(md.fd);
+	free(md.chunk_mask);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "patch.h"
+#include "client.h"
+#include "manifest.h"
+#include "changemap.h"
+
+gint patch_begin(struct cs_client *client)
+{
+	struct cs_data *cs = client->cs;
+	gchar version_str[VERSION_LENGTH] = PROJECT_VERSION;
+
+	if (cs->manifest->filesize != cs->filesize) {
+		g_critical("not yet supported: manifest filesize (%" G_GUINT64_FORMAT
+		           ") differs from local filesize (%" G_GSIZE_FORMAT ")",
+		           cs->manifest->filesize, cs->filesize);
+		return -1;
+	}
+
+	client->out_fp = g_fopen(client->name, "w");
+
+	if (!client->out_fp) {
+		g_critical("Unable to create patch %s", client->name);
+		return -1;
+	}
+
+	if (fwrite(QC_PATCH_MAGIC, strlen(QC_PATCH_MAGIC), 1, client->out_fp) != 1 ||
+	    fwrite(version_str, VERSION_LENGTH, 1, client->out_fp) != 1 ||
+	    fwrite_le64(client->out_fp, QC_CHUNK_SIZE) ||
+	    fwrite_le64(client->out_fp, cs->filesize) ||
+	    fwrite_le64(client->out_fp, cs->chunk_count) ||
+	    fwrite_hash128(client->out_fp, manifest_digest(cs->manifest))) {
+		g_critical("Failed to write patch header");
+		return -1;
+	}
+
+	return 0;
+}
+
+gint patch_add_chunk(struct cs_client *client, struct chunk *chnk)
+{
+	struct cs_data *cs = client->cs;
+
+	if (are_hashes_equal(cs->manifest->hashes[chnk->num - 1], chnk->hash)) {
+		g_debug("Hash equal to manifest, chunk %" G_GINT64_FORMAT " not in patch",
+		        chnk->num);
+
+		if (client->change_map) {
+			changemap_set(client->change_map, chnk, QC_CHANGE_EQUAL);
+		}
+
+		return 0;
+	}
+
+	if (!chnk->data && client_reread_chunk(client, chnk) != 0) {
+		return -1;
+	}
+
+	if (fwrite_le64(client->out_fp, chnk->num) ||
+	    fwrite_le64(client->out_fp, chnk->size) ||
+	    fwrite_hash128(client->out_fp, cs->manifest->hashes[chnk->num - 1]) ||
+	    fwrite_hash128(client->out_fp, chnk->hash) ||
+	    fwrite(chnk->data, 1, chnk->size, client->out_fp) != chnk->size) {
+		g_critical("Failed to write chunk %" G_GINT64_FORMAT " to patch", chnk->num);
+		return -1;
+	}
+
+	client->chunks_written++;
+	client->bytes_written += chnk->size;
+
+	if (client->change_map) {
+		changemap_set(client->change_map, chnk, QC_CHANGE_DIRTY);
+	}
+
+	return 0;
+}
+
+gint patch_end(struct cs_client *client)
+{
+	gint ret = 0;
+
+	if (fwrite_le64(client->out_fp, (guint64) -1) ||
+	    fwrite_le64(client->out_fp, client->chunks_written)) {
+		ret = -1;
+	}
+
+	if (fflush(client->out_fp) || fsync(fileno(client->out_fp))) {
+		ret = -1;
+	}
+
+	if (fclose(client->out_fp)) {
+		ret = -1;
+	}
+
+	client->out_fp = NULL;
+
+	if (ret) {
+		g_critical("Failed to finish patch %s", client->name);
+		return -1;
+	}
+
+	g_message("Patch %s holds %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+	          " chunks (%" G_GSIZE_FORMAT " bytes)", client->name,
+	          client->chunks_written, client->cs->chunk_count, client->bytes_written);
+
+	return 0;
+}
+
+struct patch_record {
+	guint64 num;
+	guint64 size;
+	XXH128_hash_t old_hash;
+	XXH128_hash_t hash;
+};
+
+/*
+ * Read the next record and check its data against its hash. Returns 1 at the
+ * end of the records, -1 on a damaged patch.
+ */
+static gint read_patch_record(FILE *patch, const gchar *filename,
+                              struct cs_data *cs, struct patch_record *rec,
+                              gchar *data)
+{
+	if (fread_le64(patch, &rec->num)) {
+		g_critical("Patch %s is truncated", filename);
+		return -1;
+	}
+
+	if ((gint64) rec->num < 0) {
+		return 1;
+	}
+
+	if (fread_le64(patch, &rec->size) || fread_hash128(patch, &rec->old_hash) ||
+	    fread_hash128(patch, &rec->hash)) {
+		g_critical("Patch %s is truncated", filename);
+		return -1;
+	}
+
+	if (rec->num < 1 || rec->num > cs->chunk_count ||
+	    rec->size != MIN(QC_CHUNK_SIZE,
+	                     cs->filesize - (rec->num - 1) * QC_CHUNK_SIZE)) {
+		g_critical("Patch record for chunk %" G_GUINT64_FORMAT " is invalid", rec->num);
+		return -1;
+	}
+
+	if (fread(data, 1, rec->size, patch) != rec->size) {
+		g_critical("Patch %s is truncated", filename);
+		return -1;
+	}
+
+	if (!are_hashes_equal(get_hash128(data, rec->size), rec->hash)) {
+		g_critical("Chunk %" G_GUINT64_FORMAT " of patch is corrupt", rec->num);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Hash one chunk of the target in blocks, the record data occupies the buffer */
+static gint hash_target_chunk(struct cs_data *cs, FILE *fp, guint64 num,
+                              XXH128_hash_t *hash)
+{
+	gsize size = MIN(QC_CHUNK_SIZE, cs->filesize - (num - 1) * QC_CHUNK_SIZE);
+	XXH3_state_t *state = hash128_stream_new();
+	gchar *buf = g_malloc(QC_IO_BLOCK_SIZE);
+	gint ret = 0;
+
+	if (fseeko(fp, (off_t)(num - 1) * QC_CHUNK_SIZE, SEEK_SET)) {
+		ret = -1;
+	}
+
+	for (gsize len; !ret && size; size -= len) {
+		len = MIN(size, QC_IO_BLOCK_SIZE);
+
+		if (fread(buf, 1, len, fp) != len) {
+			ret = -1;
+		} else {
+			hash128_stream_update(state, buf, len);
+		}
+	}
+
+	*hash = hash128_stream_finish(state);
+	g_free(buf);
+
+	if (ret) {
+		g_critical("Failed to read chunk %" G_GUINT64_FORMAT " of %s", num,
+		           cs->filename);
+	}
+
+	return ret;
+}
+
+/*
+ * The patch has to fit the target: every record must replace the chunk it was
+ * made for, so only the chunks the patch touches are read. With --full-scan,
+ * the whole target must also still be exactly what the manifest described.
+ * All of this and the data of every record are checked before the first
+ * write, so a wrong or damaged patch leaves the target untouched.
+ */
+gint apply_patch(struct cs_data *cs, const gchar *filename)
+{
+	gchar magic[sizeof(QC_PATCH_MAGIC) - 1];
+	gchar version_str[VERSION_LENGTH];
+	guint64 chunk_size, filesize, chunk_count;
+	guint64 records = 0, num;
+	XXH128_hash_t base_digest, old_hash;
+	struct manifest *target = NULL;
+	struct patch_record rec;
+	GString *applied = NULL;
+	off_t records_start;
+	gchar *data;
+	FILE *patch, *fp;
+	gint ret = -1;
+	gint r;
+
+	patch = g_fopen(filename, "r");
+
+	if (!patch) {
+		g_critical("Unable to open patch %s", filename);
+		return -1;
+	}
+
+	fp = g_fopen(cs->filename, "r+");
+
+	if (!fp) {
+		g_critical("Unable to open file <%s>: %s", __func__, cs->filename);
+		fclose(patch);
+		return -1;
+	}
+
+	data = g_malloc(QC_CHUNK_SIZE);
+
+	if (fread(magic, sizeof(magic), 1, patch) != 1 ||
+	    memcmp(magic, QC_PATCH_MAGIC, sizeof(magic)) != 0 ||
+	    fread(version_str, VERSION_LENGTH, 1, patch) != 1 ||
+	    fread_le64(patch, &chunk_size) ||
+	    fread_le64(patch, &filesize) ||
+	    fread_le64(patch, &chunk_count) ||
+	    fread_hash128(patch, &base_digest)) {
+		g_critical("%s is no patch", filename);
+		goto out;
+	}
+
+	version_str[VERSION_LENGTH - 1] = '\0';
+
+	if (strcmp(version_str, PROJECT_VERSION) != 0) {
+		g_critical("Version mismatch: patch version %s, own version %s",
+		           version_str, PROJECT_VERSION);
+		goto out;
+	}
+
+	if (chunk_size != QC_CHUNK_SIZE || filesize != cs->filesize ||
+	    chunk_count != cs->chunk_count) {
+		g_critical("not yet supported: patch for %" G_GUINT64_FORMAT
+		           " bytes in %" G_GUINT64_FORMAT " byte chunks, file has %"
+		           G_GSIZE_FORMAT " bytes", filesize, chunk_size, cs->filesize);
+		goto out;
+	}
+
+	if (cs->full_scan) {
+		target = manifest_of_file(cs, fp);
+
+		if (!target) {
+			goto out;
+		}
+
+		if (!are_hashes_equal(manifest_digest(target), base_digest)) {
+			g_critical("Patch %s was made for other content than %s has, nothing applied",
+			           filename, cs->filename);
+			goto out;
+		}
+	}
+
+	records_start = ftello(patch);
+
+	while (!(r = read_patch_record(patch, filename, cs, &rec, data))) {
+		if (hash_target_chunk(cs, fp, rec.num, &old_hash)) {
+			goto out;
+		}
+
+		if (!are_hashes_equal(old_hash, rec.old_hash)) {
+			g_critical("Chunk %" G_GUINT64_FORMAT " differs from the one the patch replaces, nothing applied",
+			           rec.num);
+			goto out;
+		}
+
+		records++;
+	}
+
+	if (r < 0) {
+		goto out;
+	}
+
+	if (fread_le64(patch, &num) || num != records) {
+		g_critical("Patch %s is incomplete, nothing applied", filename);
+		goto out;
+	}
+
+	g_debug("All %" G_GUINT64_FORMAT " records of %s check out", records, filename);
+
+	/* Second pass, the patch file may be reread from a changed medium */
+	applied = g_string_new(NULL);
+
+	if (fseeko(patch, records_start, SEEK_SET)) {
+		g_critical("Failed to rewind patch %s", filename);
+		goto out;
+	}
+
+	for (guint64 i = 0; i < records; i++) {
+		if (read_patch_record(patch, filename, cs, &rec, data) != 0 ||
+		    fseeko(fp, (off_t)(rec.num - 1) * QC_CHUNK_SIZE, SEEK_SET) ||
+		    fwrite(data, 1, rec.size, fp) != rec.size) {
+			g_critical("Failed to apply chunk %" G_GUINT64_FORMAT, rec.num);
+			goto out;
+		}
+
+		g_string_append_printf(applied, "%s%" G_GUINT64_FORMAT,
+		                       applied->len ? "," : "", rec.num);
+		g_info("Applied chunk %" G_GUINT64_FORMAT, rec.num);
+	}
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		g_critical("Failed to flush %s", cs->filename);
+		goto out;
+	}
+
+	g_message("Applied %" G_GUINT64_FORMAT " chunks from patch %s", records,
+	          filename);
+	ret = 0;
+
+out:
+	if (ret && applied && applied->len) {
+		g_critical("%s is partially patched, chunks written: %s", cs->filename,
+		           applied->str);
+	}
+
+	if (applied) {
+		g_string_free(applied, TRUE);
+	}
+
+	manifest_free(target);
+	g_free(data);
+	fclose(fp);
+	fclose(patch);
+
+	return ret;
+}
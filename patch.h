@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_PATCH_H
+#define QUICKCHUNK_PATCH_H
+
+#include "quickchunk.h"
+
+/*
+ * Patch file, all integers little endian:
+ *
+ *   8 bytes   magic "QCPATCH2"
+ *   32 bytes  version of the writer, zero padded
+ *   8 bytes   chunk size
+ *   8 bytes   file size
+ *   8 bytes   number of chunks
+ *   16 bytes  manifest_digest() of the manifest the patch was made against
+ *
+ * followed by one record per differing chunk
+ *
+ *   8 bytes   chunk num (starting at 1)
+ *   8 bytes   chunk size
+ *   16 bytes  XXH3-128 hash (low64, high64) of the chunk it replaces
+ *   16 bytes  XXH3-128 hash (low64, high64) of the data
+ *   n bytes   chunk data
+ *
+ * and terminated by chunk num -1 and the number of records written.
+ */
+#define QC_PATCH_MAGIC          "QCPATCH2"
+
+gint patch_begin(struct cs_client *client);
+gint patch_add_chunk(struct cs_client *client, struct chunk *chnk);
+gint patch_end(struct cs_client *client);
+gint apply_patch(struct cs_data *cs, const gchar *filename);
+
+#endif //QUICKCHUNK_PATCH_H
@@ -0,0 +1,337 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include <math.h>
+#include <sys/stat.h>
+
+#include "plan.h"
+#include "client.h"
+#include "bitmap.h"
+
+/*
+ * Count the chunks a plan extrapolates to. With a margin, reduce them to a
+ * uniform random sample, just large enough to estimate the dirty ratio within
+ * +-margin at 95% confidence. The sample size assumes the worst case ratio of
+ * 0.5 and corrects for the finite number of chunks.
+ *
+ * Every sampled chunk is read and hashed in full on both sides. For 1 TB
+ * (5000 chunks) that is 24 chunks or 4.8 GB at 20%, 95 or 19 GB at 10%,
+ * 357 or 71 GB at 5% and 3289 or 658 GB at 1%.
+ */
+void plan_sample(struct cs_data *cs)
+{
+	guint64 population = chunk_mask_count(cs);
+	gint64 *selected = g_new(gint64, MAX(population, 1));
+	gdouble margin, n0;
+	guint64 sample, n = 0;
+
+	cs->plan_population = population;
+	cs->plan_population_bytes = 0;
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		if (chunk_is_selected(cs, num)) {
+			cs->plan_population_bytes += chunk_data_size(cs, num);
+			selected[n++] = num;
+		}
+	}
+
+	if (!cs->plan_margin) {
+		g_free(selected);
+		return;
+	}
+
+	margin = cs->plan_margin / 100.0;
+	n0 = QC_PLAN_Z * QC_PLAN_Z * 0.25 / (margin * margin);
+	sample = MIN(ceil(n0 / (1 + (n0 - 1) / MAX(population, 1))), population);
+
+	/* Partial Fisher-Yates shuffle, the first entries form the sample */
+	for (guint64 i = 0; i < sample; i++) {
+		guint64 j = i + g_random_double() * (population - i);
+		gint64 tmp = selected[i];
+
+		selected[i] = selected[j];
+		selected[j] = tmp;
+	}
+
+	for (guint64 i = sample; i < population; i++) {
+		chunk_mask_clear(cs->chunk_mask, selected[i]);
+	}
+
+	g_free(selected);
+
+	g_message("Plan samples %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+	          " chunks for a margin of %.1f%%", sample, population, cs->plan_margin);
+}
+
+/* Send some data the server discards, to measure the network throughput */
+gint plan_send_probe(struct cs_client *client)
+{
+	guint64 size = QC_PLAN_PROBE_SIZE;
+	gsize bytes_read, len;
+	GError *error = NULL;
+	gchar msg[4] = { 0 };
+	gint64 start_time;
+	guint32 *buf;
+
+	/* Random data, in case the path compresses */
+	buf = g_malloc(QC_IO_BLOCK_SIZE);
+
+	for (gsize i = 0; i < QC_IO_BLOCK_SIZE / sizeof(*buf); i++) {
+		buf[i] = g_random_int();
+	}
+
+	start_time = g_get_monotonic_time();
+
+	if (send_data(client->output_stream, &size, sizeof(size),
+	              "Error writing probe size") != 0) {
+		g_free(buf);
+		return -1;
+	}
+
+	for (gsize sent = 0; sent < size; sent += len) {
+		len = MIN(size - sent, QC_IO_BLOCK_SIZE);
+
+		if (send_data(client->output_stream, buf, len,
+		              "Error writing probe data") != 0) {
+			g_free(buf);
+			return -1;
+		}
+	}
+
+	g_free(buf);
+
+	if (!g_input_stream_read_all(client->input_stream, msg, strlen(QC_ACK_MESSAGE),
+	                             &bytes_read, NULL, &error) ||
+	    g_strcmp0(msg, QC_ACK_MESSAGE) != 0) {
+		g_critical("Protocol error: probe not acknowledged");
+		return -1;
+	}
+
+	client->plan->net_rate = size * (gdouble) G_USEC_PER_SEC /
+	                         (1 + g_get_monotonic_time() - start_time);
+	g_debug("%s: network probe %.2lf MB/s", client->name,
+	        client->plan->net_rate / (1024 * 1024));
+
+	return 0;
+}
+
+void plan_record(struct plan_stats *plan, struct chunk *chnk,
+                 enum QCChange state)
+{
+	plan->compared++;
+	plan->compared_bytes += chnk->size;
+
+	if (state == QC_CHANGE_DIRTY) {
+		plan->dirty++;
+		plan->dirty_bytes += chnk->size;
+	} else if (state == QC_CHANGE_COPIED) {
+		plan->copied++;
+		plan->copied_bytes += chnk->size;
+	}
+}
+
+/* After the end of a plan session, the server tells how fast its disk is */
+gint plan_receive_rates(struct cs_client *client)
+{
+	guint64 rates[2];
+	gsize bytes_read;
+	GError *error = NULL;
+
+	if (!g_input_stream_read_all(client->input_stream, rates, sizeof(rates),
+	                             &bytes_read, NULL, &error) ||
+	    bytes_read != sizeof(rates)) {
+		g_critical("Error reading server rates: %s", error ? error->message :
+		           "connection closed");
+		return -1;
+	}
+
+	client->plan->server_read_rate = rates[0];
+	client->plan->server_write_rate = rates[1];
+
+	return 0;
+}
+
+/* Negative durations are unknown, a rate was not measured */
+static gchar *format_duration(gdouble seconds)
+{
+	guint64 s = seconds;
+
+	if (seconds < 0) {
+		return g_strdup("unknown");
+	}
+
+	return g_strdup_printf("%" G_GUINT64_FORMAT ":%02" G_GUINT64_FORMAT ":%02"
+	                       G_GUINT64_FORMAT, s / 3600, s / 60 % 60, s % 60);
+}
+
+/*
+ * Extrapolate the sample to all selected chunks. Reading and hashing on both
+ * sides overlaps with the transfer, so the slower of the two dominates.
+ */
+void plan_report(struct cs_client *client)
+{
+	struct cs_data *cs = client->cs;
+	struct plan_stats *plan = client->plan;
+	gdouble scale = plan->compared_bytes ? (gdouble) cs->plan_population_bytes /
+	                plan->compared_bytes : 0;
+	gdouble p = plan->compared ? (gdouble)(plan->dirty + plan->copied) /
+	            plan->compared : 0;
+	gdouble margin = 0;
+	gdouble read_rate, write_rate, hash_time, transfer_time;
+	gdouble dirty_bytes = plan->dirty_bytes * scale;
+	gdouble copied_bytes = plan->copied_bytes * scale;
+	gchar *total, *hashing, *transfer, *write;
+	const gdouble mb = 1024 * 1024;
+
+	if (plan->compared < cs->plan_population && cs->plan_population > 1) {
+		margin = QC_PLAN_Z * sqrt(p * (1 - p) / plan->compared *
+		                          (cs->plan_population - plan->compared) / (cs->plan_population - 1));
+	}
+
+	/* A side that read nothing has no rate, go by the other one then */
+	read_rate = reader_throughput() && plan->server_read_rate ?
+	            MIN(reader_throughput(), plan->server_read_rate) :
+	            MAX(reader_throughput(), plan->server_read_rate);
+	/* Without a measurement, assume the disk writes as fast as it reads */
+	write_rate = plan->server_write_rate ? plan->server_write_rate :
+	             plan->server_read_rate;
+	hash_time = read_rate ? cs->plan_population_bytes / read_rate : -1;
+
+	if (!dirty_bytes && !copied_bytes) {
+		transfer_time = 0;
+	} else if (write_rate && plan->net_rate) {
+		transfer_time = dirty_bytes / MIN(plan->net_rate, write_rate) +
+		                copied_bytes / write_rate;
+	} else {
+		transfer_time = -1;
+	}
+
+	write = plan->server_write_rate ? g_strdup_printf("%.0f MB/s",
+	        plan->server_write_rate / mb) : g_strdup("unknown, assuming the read rate");
+	total = format_duration(hash_time < 0 || transfer_time < 0 ? -1 :
+	                        MAX(hash_time, transfer_time));
+	hashing = format_duration(hash_time);
+	transfer = format_duration(transfer_time);
+
+	g_message("Plan for %s: compared %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+	          " chunks", client->name, plan->compared, cs->plan_population);
+	g_message("  dirty chunks:   ~%.0f (+-%.0f), thereof ~%.0f copied by the server",
+	          (plan->dirty + plan->copied) * scale,
+	          margin * cs->plan_population, plan->copied * scale);
+	g_message("  bytes on wire:  ~%.0f MB", dirty_bytes / mb);
+	g_message("  rates:          read %.0f MB/s here, %.0f MB/s on the server, network %.0f MB/s, write %s",
+	          reader_throughput() / mb, plan->server_read_rate / mb,
+	          plan->net_rate / mb, write);
+	g_message("  est. duration:  %s (hashing %s, transfer %s)", total, hashing,
+	          transfer);
+
+	if (plan->compared == cs->plan_population && (plan->dirty || plan->copied)) {
+		cs->plan_differs = TRUE;
+	}
+
+	g_free(total);
+	g_free(hashing);
+	g_free(transfer);
+	g_free(write);
+}
+
+void plan_receive_probe(struct cs_data *cs, GInputStream *input_stream,
+                        GOutputStream *output_stream)
+{
+	gsize bytes_read, bytes_written, len;
+	GError *error = NULL;
+	guint64 size;
+
+	if (!g_input_stream_read_all(input_stream, &size, sizeof(size), &bytes_read,
+	                             NULL, &error) || bytes_read != sizeof(size)) {
+		g_error("Error reading probe size");
+	}
+
+	if (size > QC_PLAN_MAX_PROBE_SIZE) {
+		g_error("protocol error: probe of %" G_GUINT64_FORMAT " bytes", size);
+	}
+
+	cs->server->probe = g_malloc(QC_IO_BLOCK_SIZE);
+	cs->server->probe_size = size;
+
+	for (guint64 received = 0; received < size; received += len) {
+		len = MIN(size - received, QC_IO_BLOCK_SIZE);
+
+		if (!g_input_stream_read_all(input_stream, cs->server->probe, len,
+		                             &bytes_read, NULL, &error) || bytes_read != len) {
+			g_error("Error reading probe data");
+		}
+	}
+
+	if (!g_output_stream_write_all(output_stream, QC_ACK_MESSAGE,
+	                               strlen(QC_ACK_MESSAGE), &bytes_written, NULL,
+	                               &error)) {
+		g_error("Error sending probe ACK: %s", error->message);
+	}
+}
+
+/*
+ * Write the probe data to an unnamed temporary file next to the image, which
+ * vanishes on close. The image itself is never written during a plan. For a
+ * block device there is no such place, the rate stays unknown.
+ */
+static gdouble measure_write_rate(struct cs_data *cs)
+{
+	gchar *dir = g_path_get_dirname(cs->filename);
+	struct stat st;
+	gint64 start_time;
+	gdouble rate = 0;
+	gint fd = -1;
+
+	if (g_stat(cs->filename, &st) == 0 && S_ISREG(st.st_mode)) {
+		fd = open(dir, O_TMPFILE | O_WRONLY, 0600);
+	}
+
+	g_free(dir);
+
+	if (fd < 0) {
+		g_debug("Write rate not measurable for %s", cs->filename);
+		return 0;
+	}
+
+	start_time = g_get_monotonic_time();
+
+	for (guint64 written = 0; written < cs->server->probe_size;
+	     written += QC_IO_BLOCK_SIZE) {
+		gsize len = MIN(cs->server->probe_size - written, QC_IO_BLOCK_SIZE);
+
+		if (write(fd, cs->server->probe, len) != (ssize_t) len) {
+			close(fd);
+			return 0;
+		}
+	}
+
+	if (fdatasync(fd) == 0) {
+		rate = cs->server->probe_size * (gdouble) G_USEC_PER_SEC /
+		       (1 + g_get_monotonic_time() - start_time);
+	}
+
+	close(fd);
+
+	return rate;
+}
+
+void plan_send_rates(struct cs_data *cs, GOutputStream *output_stream)
+{
+	guint64 rates[2] = { reader_throughput(), measure_write_rate(cs) };
+	gsize bytes_written;
+	GError *error = NULL;
+
+	g_free(cs->server->probe);
+	cs->server->probe = NULL;
+
+	if (!g_output_stream_write_all(output_stream, rates, sizeof(rates),
+	                               &bytes_written, NULL, &error)) {
+		g_error("Error sending rates: %s", error->message);
+	}
+
+	g_message("Plan session: no data written, read %.0f MB/s, write %.0f MB/s",
+	          rates[0] / (1024.0 * 1024), rates[1] / (1024.0 * 1024));
+}
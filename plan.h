@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_PLAN_H
+#define QUICKCHUNK_PLAN_H
+
+#include "quickchunk.h"
+#include "changemap.h"
+
+#define QC_PLAN_PROBE_SIZE      (64 * 1024 * 1024UL) /* measures the network */
+#define QC_PLAN_MAX_PROBE_SIZE  (1024 * 1024 * 1024UL)
+#define QC_PLAN_Z               1.96 /* 95% confidence */
+
+/* What a plan session found out about one destination */
+struct plan_stats {
+	guint64 compared;
+	guint64 dirty;
+	guint64 copied;
+	gsize compared_bytes;
+	gsize dirty_bytes;
+	gsize copied_bytes;
+	gdouble net_rate;		/* bytes per second */
+	gdouble server_read_rate;
+	gdouble server_write_rate;	/* 0 if it could not be measured */
+};
+
+void plan_sample(struct cs_data *cs);
+gint plan_send_probe(struct cs_client *client);
+void plan_record(struct plan_stats *plan, struct chunk *chnk,
+                 enum QCChange state);
+gint plan_receive_rates(struct cs_client *client);
+void plan_report(struct cs_client *client);
+void plan_receive_probe(struct cs_data *cs, GInputStream *input_stream,
+                        GOutputStream *output_stream);
+void plan_send_rates(struct cs_data *cs, GOutputStream *output_stream);
+
+#endif //QUICKCHUNK_PLAN_H
@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_PROTOCOL_H
+#define QUICKCHUNK_PROTOCOL_H
+
+/*
+ * Wire protocol shared by quickchunk and quickchunk-mini. Plain C on purpose,
+ * mini is built without GLib. Integers travel in host byte order.
+ *
+ * Session header, client to server:
+ *
+ *   32 bytes  version string, NUL padded
+ *   8 bytes   file size
+ *   8 bytes   chunk count
+ *   n bytes   chunk mask, QC_MASK_BYTES(chunk count)
+ *   8 bytes   session flags, QC_SESSION_*
+ *
+ * With QC_SESSION_PARTIAL, the client adds the 8 byte block size, the 8 byte
+ * number of blocks the file spans and QC_MASK_BYTES(blocks) bytes of dirty
+ * bits. Chunk records then carry only the data of the dirty blocks of a chunk,
+ * in file order, and their hash covers only that data.
+ * With QC_SESSION_SPECULATE, the client adds its 8 byte in-flight budget and
+ * the server answers with the budget it accepts, never more than asked for.
+ * With QC_SESSION_ROLLING, the server then answers with its 8 byte cursor.
+ *
+ * Each chunk record starts with an 8 byte signed chunk num; 0 asks for a
+ * flush, a negative num ends the session. Otherwise the record follows:
+ *
+ *   8 bytes   chunk size
+ *   16 bytes  XXH3-128 hash of the chunk, low then high 64 bits
+ *   8 bytes   chunk flags, QC_CHUNK_*
+ *
+ * Responses are QC_MESSAGE_LEN bytes, one of the QC_*_MESSAGE strings.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define QC_CHUNK_SIZE           (200 * 1000000UL) /* 200 MB */
+#define QC_MAX_RETRIES          3
+#define QC_MASK_BYTES(count)    (((count) + 7) / 8)
+#define QC_DEFAULT_SERVER_IP    "127.0.0.1"
+#define QC_DEFAULT_SERVER_PORT  12345
+
+#define VERSION_LENGTH 32
+
+#define QC_ACK_MESSAGE  "ACK"
+#define QC_NOK_MESSAGE  "NOK"
+#define QC_EQL_MESSAGE  "EQL"
+#define QC_CPY_MESSAGE  "CPY"
+#define QC_RTY_MESSAGE  "RTY"
+#define QC_MESSAGE_LEN  3
+
+/* Session flags, sent after the chunk mask */
+#define QC_SESSION_ROLLING      (1 << 0)	/* server replies with the cursor */
+#define QC_SESSION_PLAN         (1 << 1)	/* dry run, the server writes nothing */
+#define QC_SESSION_SPECULATE    (1 << 2)	/* followed by the in-flight budget */
+#define QC_SESSION_PARTIAL      (1 << 3)	/* followed by the dirty blocks */
+
+/* Smaller blocks fall back to whole chunks, their bits would cost too much */
+#define QC_MIN_DIRTY_BLOCK      512
+
+/* Chunk flags, sent after the chunk hash */
+#define QC_CHUNK_SPECULATIVE    (1 << 0)	/* data follows right away */
+#define QC_CHUNK_RESEND         (1 << 1)	/* damaged speculative data again */
+
+/* Version, file size and chunk count, the part in front of the chunk mask */
+#define QC_PREAMBLE_SIZE        (VERSION_LENGTH + 2 * sizeof(uint64_t))
+
+/* Everything of a chunk record after its num */
+#define QC_RECORD_SIZE          (4 * sizeof(uint64_t))
+
+struct qc_preamble {
+	char version[VERSION_LENGTH];
+	uint64_t filesize;
+	uint64_t chunk_count;
+};
+
+struct qc_record {
+	uint64_t size;
+	uint64_t hash_low64;
+	uint64_t hash_high64;
+	uint64_t flags;
+};
+
+static inline void qc_preamble_encode(uint8_t *buf, const struct qc_preamble *pre)
+{
+	memcpy(buf, pre->version, VERSION_LENGTH);
+	memcpy(buf + VERSION_LENGTH, &pre->filesize, sizeof(uint64_t));
+	memcpy(buf + VERSION_LENGTH + sizeof(uint64_t), &pre->chunk_count,
+	       sizeof(uint64_t));
+}
+
+static inline void qc_preamble_decode(const uint8_t *buf, struct qc_preamble *pre)
+{
+	memcpy(pre->version, buf, VERSION_LENGTH);
+	pre->version[VERSION_LENGTH - 1] = '\0';
+	memcpy(&pre->filesize, buf + VERSION_LENGTH, sizeof(uint64_t));
+	memcpy(&pre->chunk_count, buf + VERSION_LENGTH + sizeof(uint64_t),
+	       sizeof(uint64_t));
+}
+
+static inline void qc_record_encode(uint8_t *buf, const struct qc_record *rec)
+{
+	memcpy(buf, &rec->size, sizeof(uint64_t));
+	memcpy(buf + 8, &rec->hash_low64, sizeof(uint64_t));
+	memcpy(buf + 16, &rec->hash_high64, sizeof(uint64_t));
+	memcpy(buf + 24, &rec->flags, sizeof(uint64_t));
+}
+
+static inline void qc_record_decode(const uint8_t *buf, struct qc_record *rec)
+{
+	memcpy(&rec->size, buf, sizeof(uint64_t));
+	memcpy(&rec->hash_low64, buf + 8, sizeof(uint64_t));
+	memcpy(&rec->hash_high64, buf + 16, sizeof(uint64_t));
+	memcpy(&rec->flags, buf + 24, sizeof(uint64_t));
+}
+
+/*
+ * Dirty bitmap file, all integers little endian:
+ *
+ *   8 bytes   magic "QCBITMAP"
+ *   8 bytes   block size in bytes
+ *   8 bytes   number of blocks
+ *   n bytes   (blocks + 7) / 8 bytes of bitmap, bit (i % 8) of byte (i / 8)
+ *             set means block i changed since the last backup
+ *
+ * Blocks beyond the end of the bitmap count as changed.
+ */
+#define QC_BITMAP_MAGIC         "QCBITMAP"
+#define QC_BITMAP_HEADER_SIZE   24
+
+enum qc_bitmap_error {
+	QC_BITMAP_OK,
+	QC_BITMAP_NO_BITMAP,	/* too short or wrong magic */
+	QC_BITMAP_INVALID	/* truncated, or block size and count out of range */
+};
+
+/*
+ * Check the header of a dirty bitmap of length bytes. The values may be
+ * anything, so they are bounded by division before any arithmetic uses them.
+ */
+static inline enum qc_bitmap_error qc_bitmap_parse(const uint8_t *buf,
+                uint64_t length, uint64_t *block_size, uint64_t *block_count)
+{
+	if (length < QC_BITMAP_HEADER_SIZE ||
+	    memcmp(buf, QC_BITMAP_MAGIC, strlen(QC_BITMAP_MAGIC)) != 0) {
+		return QC_BITMAP_NO_BITMAP;
+	}
+
+	memcpy(block_size, buf + 8, sizeof(uint64_t));
+	memcpy(block_count, buf + 16, sizeof(uint64_t));
+	*block_size = le64toh(*block_size);
+	*block_count = le64toh(*block_count);
+
+	if (!*block_size || *block_count > (length - QC_BITMAP_HEADER_SIZE) * 8 ||
+	    (*block_count && *block_size > UINT64_MAX / *block_count)) {
+		return QC_BITMAP_INVALID;
+	}
+
+	return QC_BITMAP_OK;
+}
+
+/* Whether any block overlapping the bytes [start, end) changed */
+static inline int qc_bitmap_range_dirty(const uint8_t *bits, uint64_t block_size,
+                                        uint64_t block_count, uint64_t start,
+                                        uint64_t end)
+{
+	uint64_t i = start / block_size;
+	uint64_t last = (end - 1) / block_size;
+
+	if (last >= block_count) {
+		return 1;
+	}
+
+	while (i <= last) {
+		/* Whole bytes at once where possible */
+		if (i % 8 == 0 && i + 7 <= last) {
+			if (bits[i / 8]) {
+				return 1;
+			}
+
+			i += 8;
+			continue;
+		}
+
+		if ((bits[i / 8] >> (i % 8)) & 1) {
+			return 1;
+		}
+
+		i++;
+	}
+
+	return 0;
+}
+
+#endif //QUICKCHUNK_PROTOCOL_H
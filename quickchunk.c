@@ -6,8 +6,16 @@
 #include "quickchunk.h"
 #include "client.h"
 #include "server.h"
-
-static XXH128_hash_t get_hash128(const void *buf, gsize size)
+#include "bitmap.h"
+#include "manifest.h"
+#include "patch.h"
+#include "local.h"
+#include "changemap.h"
+#include "roll.h"
+#include "plan.h"
+#include "history.h"
+
+XXH128_hash_t get_hash128(const void *buf, gsize size)
 {
 	XXH128_hash_t hash = {0, 0};
 
@@ -25,6 +33,247 @@ static XXH128_hash_t get_hash128(const void *buf, gsize size)
 	return hash;
 }
 
+/* Streaming counterpart of get_hash128() for data arriving in pieces */
+XXH3_state_t *hash128_stream_new(void)
+{
+	XXH3_state_t *state = XXH3_createState();
+
+	if (!state || XXH3_128bits_reset(state) != XXH_OK) {
+		g_error("Unable to set up hash state");
+	}
+
+	return state;
+}
+
+void hash128_stream_update(XXH3_state_t *state, const void *buf, gsize size)
+{
+#if defined(__x86_64__)
+	XXH3_128bits_update_dispatch(state, buf, (size_t)size);
+#else
+	XXH3_128bits_update(state, buf, (size_t)size);
+#endif
+}
+
+XXH128_hash_t hash128_stream_finish(XXH3_state_t *state)
+{
+	XXH128_hash_t hash = XXH3_128bits_digest(state);
+
+	XXH3_freeState(state);
+
+	return hash;
+}
+
+gboolean are_hashes_equal(XXH128_hash_t hash1, XXH128_hash_t hash2)
+{
+	return (hash1.low64 == hash2.low64) && (hash1.high64 == hash2.high64);
+}
+
+/* File formats store integers little endian */
+gint fwrite_le64(FILE *fp, guint64 val)
+{
+	val = GUINT64_TO_LE(val);
+
+	return fwrite(&val, sizeof(val), 1, fp) == 1 ? 0 : -1;
+}
+
+gint fread_le64(FILE *fp, guint64 *val)
+{
+	if (fread(val, sizeof(*val), 1, fp) != 1) {
+		return -1;
+	}
+
+	*val = GUINT64_FROM_LE(*val);
+
+	return 0;
+}
+
+gint fwrite_hash128(FILE *fp, XXH128_hash_t hash)
+{
+	if (fwrite_le64(fp, hash.low64) || fwrite_le64(fp, hash.high64)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+gint fread_hash128(FILE *fp, XXH128_hash_t *hash)
+{
+	guint64 low64, high64;
+
+	if (fread_le64(fp, &low64) || fread_le64(fp, &high64)) {
+		return -1;
+	}
+
+	hash->low64 = low64;
+	hash->high64 = high64;
+
+	return 0;
+}
+
+/*
+ * Let writer write the content to a temporary file and rename it over
+ * filename once it is on disk, so a crash leaves the previous file intact.
+ * what names the file in messages.
+ */
+gint save_atomically(const gchar *filename, const gchar *what,
+                     gint (*writer)(FILE *fp, gpointer data), gpointer data)
+{
+	gchar *tmp = g_strdup_printf("%s.tmp", filename);
+	gint ret;
+	FILE *fp;
+
+	fp = g_fopen(tmp, "w");
+
+	if (!fp) {
+		g_critical("Unable to create %s %s", what, tmp);
+		g_free(tmp);
+		return -1;
+	}
+
+	ret = writer(fp, data);
+
+	if (!ret && (fflush(fp) || fsync(fileno(fp)))) {
+		ret = -1;
+	}
+
+	if (fclose(fp) || ret || g_rename(tmp, filename)) {
+		g_critical("Failed to write %s %s", what, filename);
+		g_unlink(tmp);
+		g_free(tmp);
+		return -1;
+	}
+
+	g_free(tmp);
+	g_debug("Wrote %s %s", what, filename);
+
+	return 0;
+}
+
+/*
+ * Copy a range in the kernel where possible, which also shares the extents on
+ * copy-on-write filesystems, and through user space otherwise. Returns -1 with
+ * errno set on failure, EIO for a short read or write.
+ */
+gint copy_range(gint src_fd, off_t src_offset, gint dst_fd, off_t dst_offset,
+                gsize size)
+{
+	loff_t src_off = src_offset;
+	loff_t dst_off = dst_offset;
+	gsize remaining = size;
+	gchar *buf;
+	ssize_t n;
+
+	while (remaining) {
+		n = copy_file_range(src_fd, &src_off, dst_fd, &dst_off, remaining, 0);
+
+		if (n <= 0) {
+			break;
+		}
+
+		remaining -= n;
+	}
+
+	if (!remaining) {
+		return 0;
+	}
+
+	g_debug("copy_file_range not usable (%s), copying through user space",
+	        g_strerror(errno));
+
+	buf = g_malloc(QC_IO_BLOCK_SIZE);
+
+	while (remaining) {
+		gsize len = MIN(remaining, QC_IO_BLOCK_SIZE);
+
+		errno = 0;
+		n = pread(src_fd, buf, len, src_off);
+
+		if (n <= 0 || pwrite(dst_fd, buf, n, dst_off) != n) {
+			/* Short reads and writes leave errno alone */
+			gint err = errno ? errno : EIO;
+
+			g_free(buf);
+			errno = err;
+			return -1;
+		}
+
+		src_off += n;
+		dst_off += n;
+		remaining -= n;
+	}
+
+	g_free(buf);
+
+	return 0;
+}
+
+struct chunk *chunk_ref(struct chunk *chnk)
+{
+	g_atomic_int_inc(&chnk->ref_count);
+
+	return chnk;
+}
+
+void chunk_unref(struct chunk *chnk)
+{
+	if (g_atomic_int_dec_and_test(&chnk->ref_count)) {
+		g_free(chnk->data);
+		g_free(chnk);
+	}
+}
+
+guint8 *chunk_mask_new(guint64 chunk_count)
+{
+	guint8 *mask = g_malloc(QC_MASK_BYTES(chunk_count));
+
+	/* By default every chunk takes part */
+	memset(mask, 0xff, QC_MASK_BYTES(chunk_count));
+
+	return mask;
+}
+
+void chunk_mask_clear(guint8 *mask, gint64 num)
+{
+	mask[(num - 1) / 8] &= ~(1 << ((num - 1) % 8));
+}
+
+gboolean chunk_is_selected(struct cs_data *cs, gint64 num)
+{
+	return (cs->chunk_mask[(num - 1) / 8] >> ((num - 1) % 8)) & 1;
+}
+
+guint64 chunk_mask_count(struct cs_data *cs)
+{
+	guint64 count = 0;
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		count += chunk_is_selected(cs, num);
+	}
+
+	return count;
+}
+
+/*
+ * Chunk number at position pos (1-based) of a session. Sessions visit the
+ * chunks in order, starting at the cursor and wrapping around.
+ */
+gint64 chunk_at(struct cs_data *cs, guint64 pos)
+{
+	return (cs->cursor - 1 + pos - 1) % cs->chunk_count + 1;
+}
+
+/* Once used up, the budget stays used up, so sessions stop at a boundary */
+gboolean budget_used_up(struct cs_data *cs)
+{
+	/* Reader and client threads ask, the flag is shared between them */
+	if (cs->deadline && !g_atomic_int_get(&cs->budget_exhausted) &&
+	    g_get_monotonic_time() >= cs->deadline) {
+		g_atomic_int_set(&cs->budget_exhausted, TRUE);
+	}
+
+	return g_atomic_int_get(&cs->budget_exhausted);
+}
+
 gint is_file_existant(gchar *filename)
 {
 	struct stat status;
@@ -35,6 +284,25 @@ gint is_file_existant(gchar *filename)
 	return ret;
 }
 
+static gsize get_file_size(const gchar *filename)
+{
+	FILE *fp;
+	gsize size;
+
+	fp = g_fopen(filename, "r");
+
+	if (!fp) {
+		g_error("Unable to open file <%s>: %s", __func__, filename);
+	}
+
+	/* Works for block devices as well, unlike stat() */
+	fseeko(fp, 0L, SEEK_END);
+	size = ftello(fp);
+	fclose(fp);
+
+	return size;
+}
+
 static gint64 total_elapsed_microseconds = 0;
 static gint64 total_bytes_read = 0;
 
@@ -54,6 +322,16 @@ static void print_read_time_and_throughput(gint64 start_time,
 	       elapsed_seconds, throughput);
 }
 
+/* Bytes per second the reader got from the disk so far, 0 if nothing yet */
+gdouble reader_throughput(void)
+{
+	if (!total_elapsed_microseconds) {
+		return 0;
+	}
+
+	return total_bytes_read * (gdouble) G_USEC_PER_SEC / total_elapsed_microseconds;
+}
+
 static void print_overall_read_throughput()
 {
 	gdouble overall_elapsed_seconds = total_elapsed_microseconds / 1e6;
@@ -64,20 +342,84 @@ static void print_overall_read_throughput()
 	          overall_elapsed_seconds, overall_throughput);
 }
 
+static gboolean clients_window_full(struct cs_data *cs)
+{
+	for (guint i = 0; i < cs->clients->len; i++) {
+		struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+		if (g_atomic_int_get(&client->window) < QC_MAX_READER_QUEUE) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Hash-only entries are small, but each may cost a re-read, so cap them too */
+static gboolean clients_lag_too_far(struct cs_data *cs)
+{
+	for (guint i = 0; i < cs->clients->len; i++) {
+		struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+		if (g_async_queue_length(client->async_queue) >= QC_MAX_CLIENT_LAG) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Hand one chunk to every destination. Destinations with room in their window
+ * share the buffer, the others only get its hash and read the data again
+ * themselves if their server asks for it. This way a slow destination never
+ * stalls the reader, and thereby the fast ones.
+ */
+static void clients_dispatch_chunk(struct cs_data *cs, struct chunk *chnk)
+{
+	for (guint i = 0; i < cs->clients->len; i++) {
+		struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+		if (g_atomic_int_get(&client->window) < QC_MAX_READER_QUEUE) {
+			g_atomic_int_inc(&client->window);
+			g_async_queue_push(client->async_queue, chunk_ref(chnk));
+		} else {
+			struct chunk *lagging = g_new0(struct chunk, 1);
+
+			lagging->num = chnk->num;
+			lagging->hash = chnk->hash;
+			lagging->size = chnk->size;
+			lagging->partial = chnk->partial;
+			lagging->ref_count = 1;
+			g_async_queue_push(client->async_queue, lagging);
+		}
+	}
+
+	chunk_unref(chnk);
+}
+
 static void *reader_thr(void *data)
 {
 	struct cs_data *cs = (struct cs_data *) data;
 	struct chunk *chnk;
+	GArray *extents;
+	gboolean partial;
 	FILE *fp;
-	gint ret;
-	guint64 chnk_num = 0;
-	gsize n;
+	guint64 pos, chnk_num;
 	gint64 start_time;
 
-	ret = is_file_existant(cs->filename);
+	if (cs->is_server) {
+		/* The client decides which chunks take part in this session */
+		server_wait_for_session(cs);
+	} else {
+		/* A rolling session starts where the server says */
+		g_mutex_lock(&cs->mutex);
 
-	if (!ret) {
-		g_error("File not found: \"%s\"", cs->filename);
+		while (!cs->cursor) {
+			g_cond_wait(&cs->cond, &cs->mutex);
+		}
+
+		g_mutex_unlock(&cs->mutex);
 	}
 
 	fp = g_fopen(cs->filename, "r");
@@ -86,51 +428,76 @@ static void *reader_thr(void *data)
 		g_error("Unable to open file <%s>: %s", __func__, cs->filename);
 	}
 
-	fseek(fp, 0L, SEEK_END);
-	cs->filesize = ftell(fp);
-	rewind(fp);
-	g_debug("File: %s has size: %lu", cs->filename, cs->filesize);
+	if (cs->is_server && cs->index_scan) {
+		server_index_scan(cs, fp);
+	}
+
+	for (pos = 1; pos <= cs->chunk_count; pos++) {
+		chnk_num = chunk_at(cs, pos);
+		off_t offset = (off_t)(chnk_num - 1) * QC_CHUNK_SIZE;
+		gsize size = MIN(QC_CHUNK_SIZE, cs->filesize - offset);
 
-	while (ftell(fp) < cs->filesize) {
-		while (g_async_queue_length(cs->async_queue) >= QC_MAX_READER_QUEUE) {
+		if (!chunk_is_selected(cs, chnk_num)) {
+			cs->current_file_position += size;
+			continue;
+		}
+
+		while (cs->is_server ?
+		       g_async_queue_length(cs->async_queue) >= QC_MAX_READER_QUEUE &&
+		       !g_atomic_int_get(&cs->session_ended) :
+		       clients_window_full(cs) || clients_lag_too_far(cs)) {
 			g_usleep(QC_WAIT_TIME);
 		}
 
+		/* The client may end a session early, e.g. out of time budget */
+		if (cs->is_server ? g_atomic_int_get(&cs->session_ended) : budget_used_up(cs)) {
+			break;
+		}
+
+		/* With dirty blocks, only those are read, on both sides */
+		extents = chunk_extents(cs, chnk_num, &partial);
+
 		chnk = g_new0(struct chunk, 1);
-		chnk_num++;
 		chnk->num = chnk_num;
+		chnk->size = extents_size(extents);
+		chnk->partial = partial;
+		chnk->ref_count = 1;
 
-		if ((ftell(fp) + QC_CHUNK_SIZE) < cs->filesize) {
-			chnk->size = QC_CHUNK_SIZE;
-		} else {
-			chnk->size = cs->filesize - ftell(fp);
+		if (!chnk->size) {
+			g_error("Chunk %" G_GUINT64_FORMAT " selected without dirty blocks", chnk_num);
 		}
 
-
 		chnk->data = (gchar *) g_malloc(chnk->size * sizeof(gchar));
 
 		start_time = g_get_monotonic_time();
-		n = fread(chnk->data, 1, chnk->size, fp);
 
-		if (n != chnk->size) {
-			g_error("Failed to read %lu bytes, got %lu", chnk->size, n);
+		if (read_extents(fp, extents, chnk->data)) {
+			g_error("Failed to read %lu bytes of chunk %" G_GUINT64_FORMAT, chnk->size,
+			        chnk_num);
 		}
 
-		cs->current_file_position += n;
+		g_array_free(extents, TRUE);
+		cs->current_file_position += size;
 
-		print_read_time_and_throughput(start_time, n);
+		print_read_time_and_throughput(start_time, chnk->size);
 
 		chnk->hash = get_hash128(chnk->data, chnk->size);
 		g_debug("%s item:%lu size:%lu hash:0x%lx%lx", __func__, chnk->num, chnk->size,
 		        chnk->hash.low64, chnk->hash.high64);
 
 		if (cs->is_server) {
+			/* The index only knows whole chunks */
+			if (!chnk->partial) {
+				server_index_add(cs, chnk->num, chnk->hash, chnk->size);
+			}
+
 			/* No need to keep the actual data in server mode */
 			g_free(chnk->data);
+			chnk->data = NULL;
+			g_async_queue_push(cs->async_queue, chnk);
+		} else {
+			clients_dispatch_chunk(cs, chnk);
 		}
-
-		g_async_queue_push(cs->async_queue, chnk);
-		g_debug("%s item:%lu size:%lu", __func__, chnk->num, chnk->size);
 	}
 
 	fclose(fp);
@@ -146,54 +513,115 @@ static void *worker_thr(void *data)
 	struct cs_data *cs = (struct cs_data *) data;
 	struct chunk *chnk;
 
-	while (g_async_queue_length(cs->async_queue) || !cs->is_readthread_finished) {
+	while ((g_async_queue_length(cs->async_queue) || !cs->is_readthread_finished) &&
+	       !g_atomic_int_get(&cs->session_ended)) {
 
 		chnk = g_async_queue_timeout_pop(cs->async_queue, QC_WAIT_TIME);
 
 		if (chnk) {
-			if (cs->is_server) {
-				g_mutex_lock(&cs->server->mutex);
-				cs->server->current_num = chnk->num;
-				cs->server->current_hash = chnk->hash;
-				cs->server->update_current_finished = TRUE;
-				g_cond_signal(&cs->server->cond);
-				g_mutex_unlock(&cs->server->mutex);
-
-				g_mutex_lock(&cs->mutex);
-				init_server(cs);
-				g_debug("waiting for client");
-
-				while (!cs->server_one_chunk_finished) {
-					//Mutex is released while waiting, and locked again before returning
-					g_cond_wait(&cs->cond, &cs->mutex);
-				}
-
-				g_debug("client handled");
-				cs->server_one_chunk_finished = FALSE;
-				g_mutex_unlock(&cs->mutex);
-			} else {
-				// is client
-				init_client(cs);
-
-				if (client_check_and_upload(cs, chnk)) {
-					g_error("Upload Error");
-				}
-
-				g_free(chnk->data);
+			g_mutex_lock(&cs->server->mutex);
+			cs->server->current_num = chnk->num;
+			cs->server->current_hash = chnk->hash;
+			cs->server->update_current_finished = TRUE;
+			g_cond_signal(&cs->server->cond);
+			g_mutex_unlock(&cs->server->mutex);
+
+			g_mutex_lock(&cs->mutex);
+			g_debug("waiting for client");
+
+			while (!cs->server_one_chunk_finished &&
+			       !g_atomic_int_get(&cs->session_ended)) {
+				//Mutex is released while waiting, and locked again before returning
+				g_cond_wait(&cs->cond, &cs->mutex);
 			}
 
-			g_free(chnk);
+			g_debug("client handled");
+			cs->server_one_chunk_finished = FALSE;
+			g_mutex_unlock(&cs->mutex);
+
+			chunk_unref(chnk);
 		}
 	}
 
-	if (!cs->is_server) { // is client
-		client_send_exit(cs);
-	}
+	server_wait_for_session_end(cs);
 
 	g_main_loop_quit(cs->main_loop);
 	return NULL;
 }
 
+static void *client_worker_thr(void *data)
+{
+	struct cs_client *client = (struct cs_client *) data;
+	struct cs_data *cs = client->cs;
+	struct chunk *chnk;
+	guint64 chunks_left = 0;
+
+	if (client_begin(client)) {
+		g_error("Session Error (%s)", client->name);
+	}
+
+	while (g_async_queue_length(client->async_queue) || !cs->is_readthread_finished) {
+
+		chnk = g_async_queue_timeout_pop(client->async_queue, QC_WAIT_TIME);
+
+		if (chnk) {
+			gboolean had_data = chnk->data != NULL;
+
+			if (budget_used_up(cs)) {
+				/* Leave this and all further chunks to the next window */
+				chunks_left++;
+			} else if (client_handle_chunk(client, chnk)) {
+				g_error("Upload Error (%s)", client->name);
+			}
+
+			if (had_data) {
+				g_atomic_int_add(&client->window, -1);
+			}
+
+			chunk_unref(chnk);
+		}
+	}
+
+	if (client_end(client)) {
+		g_error("Session Error (%s)", client->name);
+	}
+
+	if (client->change_map &&
+	    changemap_save(client->change_map, client->change_map_filename)) {
+		g_error("Session Error (%s)", client->name);
+	}
+
+	if (g_atomic_int_get(&cs->budget_exhausted)) {
+		g_message("Time budget used up, %" G_GUINT64_FORMAT
+		          " queued chunks and the unread rest are left for the next window",
+		          chunks_left);
+	}
+
+	if (client->history &&
+	    history_save(client->history, client->history_filename)) {
+		g_error("Session Error (%s)", client->name);
+	}
+
+	if (client->plan) {
+		plan_report(client);
+	}
+
+	if (client->in_flight) {
+		client_report_speculation(client);
+	}
+
+	if (client->chunks_reread) {
+		g_message("%s fell behind, re-read %" G_GUINT64_FORMAT " chunks",
+		          client->name, client->chunks_reread);
+	}
+
+	if (g_atomic_int_dec_and_test(&cs->active_workers)) {
+		g_main_loop_quit(cs->main_loop);
+	}
+
+	return NULL;
+}
+
 static void *status_thr(void *data)
 {
 	struct cs_data *cs = (struct cs_data *) data;
@@ -266,27 +694,51 @@ static gboolean cs_verbosity_arg_func(const gchar *option_name,
 int main(int argc, char *argv[])
 {
 	GThread *reader_thread;
-	GThread *worker_thread;
+	GThread *worker_thread = NULL;
 	GThread *status_thread;
+	GPtrArray *client_threads;
+	struct chunk *chnk;
 	struct cs_data *cs;
 	GError *error = NULL;
 	GOptionContext *context;
+	gboolean ip_given;
 	gint64 start_time = g_get_monotonic_time();
+	gint ret;
 
 	cs = g_new0(struct cs_data, 1);
-	cs->client = g_new0(struct cs_client, 1);
 	cs->server = g_new0(struct cs_server, 1);
 
 	g_mutex_init(&cs->mutex);
 	g_mutex_init(&cs->server->mutex);
 	g_cond_init(&cs->cond);
 	g_cond_init(&cs->server->cond);
+	g_cond_init(&cs->server->session_cond);
 
 	GOptionEntry entries[] = {
 		{ "server", 's', 0, G_OPTION_ARG_NONE, &cs->is_server, "Run in server mode", NULL },
 		{ "ip", 'i', 0, G_OPTION_ARG_STRING, &cs->server_ip, "IP address to use", "IP" },
 		{ "port", 'p', 0, G_OPTION_ARG_INT, &cs->server_port, "Port to use", "PORT" },
+		{ "dest", 'd', 0, G_OPTION_ARG_STRING_ARRAY, &cs->destinations, "Client: server to sync to as well, can be repeated", "IP[:PORT]" },
 		{ "file", 'f', 0, G_OPTION_ARG_FILENAME, &cs->filename, "File to use", "FILE" },
+		{ "dirty-bitmap", 'b', 0, G_OPTION_ARG_FILENAME, &cs->dirty_bitmap, "Client: only read chunks flagged as changed in this bitmap", "FILE" },
+		{ "full-scan", 0, 0, G_OPTION_ARG_NONE, &cs->full_scan, "Client: ignore --dirty-bitmap and read everything; with --apply-patch, check the whole file", NULL },
+		{ "target", 't', 0, G_OPTION_ARG_FILENAME, &cs->target, "Sync FILE to this file on the same host, without network", "TARGET" },
+		{ "index-scan", 0, 0, G_OPTION_ARG_NONE, &cs->index_scan, "Server: hash the whole file first, to find relocated content anywhere in it", NULL },
+		{ "verify", 0, 0, G_OPTION_ARG_STRING, &cs->verify_mode, "Server: check received data against its hash: none, stream (default) or full (plus read-after-write)", "MODE" },
+		{ "export-manifest", 'm', 0, G_OPTION_ARG_FILENAME, &cs->export_manifest, "Write the chunk hashes of FILE to this manifest", "MANIFEST" },
+		{ "manifest", 0, 0, G_OPTION_ARG_FILENAME, &cs->manifest_filename, "Client: manifest of the server's file, for --patch", "MANIFEST" },
+		{ "patch", 0, 0, G_OPTION_ARG_FILENAME, &cs->patch_filename, "Client: write chunks differing from --manifest to this patch file", "PATCH" },
+		{ "apply-patch", 0, 0, G_OPTION_ARG_FILENAME, &cs->apply_patch, "Apply this patch file to FILE and exit", "PATCH" },
+		{ "time-budget", 0, 0, G_OPTION_ARG_INT, &cs->time_budget, "Client: stop starting chunks after this many seconds, the next run continues there", "SECONDS" },
+		{ "roll-state", 0, 0, G_OPTION_ARG_FILENAME, &cs->roll_state, "Server: keep the cursor of time-budgeted sessions in this file", "STATE" },
+		{ "stale-windows", 0, 0, G_OPTION_ARG_INT, &cs->stale_windows, "Server: report ranges not synced within the last N time-budgeted sessions", "N" },
+		{ "plan", 0, 0, G_OPTION_ARG_NONE, &cs->plan, "Client: dry run, compare with the server and estimate the sync without writing", NULL },
+		{ "plan-margin", 0, 0, G_OPTION_ARG_DOUBLE, &cs->plan_margin, "Client: let --plan compare only a random sample, good for +-PERCENT", "PERCENT" },
+		{ "history", 0, 0, G_OPTION_ARG_FILENAME, &cs->history, "Client: keep the change history of every chunk across sessions in this file", "FILE" },
+		{ "speculate", 0, 0, G_OPTION_ARG_INT, &cs->speculate, "Client: send chunks the --history predicts dirty right away, up to N in flight; Server: hold at most N of them in memory", "N" },
+		{ "change-map", 'c', 0, G_OPTION_ARG_FILENAME, &cs->change_map, "Write which chunks changed in this session to a change map", "MAP" },
+		{ "heatmap", 0, 0, G_OPTION_ARG_FILENAME, &cs->heatmap, "Merge the change maps given as arguments into a CSV heatmap and exit", "CSV" },
+		{ G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &cs->remaining, NULL, "[MAP...]" },
 		{ "verbose", 'v', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK, cs_verbosity_arg_func, "Increase verbosity", NULL },
 		{ NULL }
 	};
@@ -301,6 +753,8 @@ int main(int argc, char *argv[])
 		g_error("option parsing failed: %s", error->message);
 	}
 
+	ip_given = cs->server_ip != NULL;
+
 	if (!cs->server_ip) {
 		cs->server_ip = QC_DEFAULT_SERVER_IP;
 	}
@@ -309,12 +763,25 @@ int main(int argc, char *argv[])
 		cs->server_port = QC_DEFAULT_SERVER_PORT;
 	}
 
+	if (cs->heatmap) {
+		return write_heatmap(cs->heatmap, cs->remaining) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (cs->remaining) {
+		g_error("Unexpected argument %s, only --heatmap takes change maps",
+		        cs->remaining[0]);
+	}
+
 	if (!cs->filename) {
 		g_error("missing filename");
 	}
 
 	if (cs->is_server) {
 		g_message("NOTE: Selected file (%s) gets altered by client.", cs->filename);
+
+		if (cs->destinations) {
+			g_error("--dest is a client option");
+		}
 	}
 
 	g_debug("IP Address: %s", cs->server_ip);
@@ -322,6 +789,129 @@ int main(int argc, char *argv[])
 	g_debug("Filename: %s", cs->filename);
 	g_debug("is server: %d", cs->is_server);
 
+	if (!is_file_existant(cs->filename)) {
+		g_error("File not found: \"%s\"", cs->filename);
+	}
+
+	cs->filesize = get_file_size(cs->filename);
+	cs->chunk_count = (cs->filesize + QC_CHUNK_SIZE - 1) / QC_CHUNK_SIZE;
+	cs->chunk_mask = chunk_mask_new(cs->chunk_count);
+	g_debug("File: %s has size: %lu", cs->filename, cs->filesize);
+
+	if (!cs->verify_mode || g_strcmp0(cs->verify_mode, "stream") == 0) {
+		cs->verify = QC_VERIFY_STREAM;
+	} else if (g_strcmp0(cs->verify_mode, "none") == 0) {
+		cs->verify = QC_VERIFY_NONE;
+	} else if (g_strcmp0(cs->verify_mode, "full") == 0) {
+		cs->verify = QC_VERIFY_FULL;
+	} else {
+		g_error("Unknown verify mode: %s", cs->verify_mode);
+	}
+
+	if (cs->apply_patch) {
+		return apply_patch(cs, cs->apply_patch) ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (cs->target && (cs->is_server || ip_given || cs->destinations)) {
+		g_error("--target syncs locally, without any server");
+	}
+
+	if (cs->time_budget < 0 || cs->stale_windows < 0) {
+		g_error("--time-budget and --stale-windows must not be negative");
+	}
+
+	if (cs->time_budget && (cs->is_server || cs->target || cs->destinations ||
+	                        cs->patch_filename || cs->export_manifest)) {
+		g_error("--time-budget is for a client syncing to exactly one server");
+	}
+
+	if (cs->plan_margin < 0 || cs->plan_margin >= 100 ||
+	    (cs->plan_margin && !cs->plan)) {
+		g_error("--plan-margin takes a percentage for --plan");
+	}
+
+	if (cs->plan && (cs->is_server || cs->target || cs->time_budget ||
+	                 cs->patch_filename || cs->export_manifest)) {
+		g_error("--plan compares with servers only, without --time-budget");
+	}
+
+	if (cs->speculate < 0 || cs->speculate > QC_MAX_SPECULATE) {
+		g_error("--speculate takes 0 to %d chunks", QC_MAX_SPECULATE);
+	}
+
+	if (cs->speculate && !cs->is_server && !cs->history) {
+		g_error("--speculate needs a --history");
+	}
+
+	/* A plan writes nothing, so it must not count as a session either */
+	if (cs->history && (cs->is_server || cs->target || cs->plan)) {
+		g_error("--history is a client option for servers, without --plan");
+	}
+
+	/* Like the server, a plan leaves no change map behind */
+	if (cs->change_map && cs->plan) {
+		g_error("--change-map records a session, it cannot be combined with --plan");
+	}
+
+	if (cs->index_scan && !cs->is_server) {
+		g_error("--index-scan is a server option");
+	}
+
+	if (cs->verify_mode && !cs->is_server) {
+		g_error("--verify is a server option");
+	}
+
+	if ((cs->roll_state || cs->stale_windows) && !cs->is_server) {
+		g_error("--roll-state and --stale-windows are server options");
+	}
+
+	if (cs->is_server && (cs->patch_filename || cs->export_manifest)) {
+		g_error("--patch and --export-manifest are client options");
+	}
+
+	if (cs->patch_filename) {
+		if (!cs->manifest_filename) {
+			g_error("--patch needs the server's --manifest");
+		}
+
+		cs->manifest = manifest_load(cs->manifest_filename);
+
+		if (!cs->manifest) {
+			g_error("Unable to use manifest %s", cs->manifest_filename);
+		}
+	}
+
+	if (cs->export_manifest && cs->dirty_bitmap && !cs->full_scan) {
+		g_error("--export-manifest needs a full scan, not a --dirty-bitmap");
+	}
+
+	if (cs->dirty_bitmap && cs->full_scan) {
+		g_message("Full scan requested, ignoring dirty bitmap %s", cs->dirty_bitmap);
+	} else if (cs->dirty_bitmap) {
+		if (cs->is_server) {
+			g_error("--dirty-bitmap is a client option");
+		}
+
+		if (load_dirty_bitmap(cs, cs->dirty_bitmap) != 0) {
+			g_error("Unable to use dirty bitmap %s", cs->dirty_bitmap);
+		}
+	}
+
+	if (cs->plan) {
+		plan_sample(cs);
+	}
+
+	if (cs->target) {
+		gint ret;
+
+		status_thread = g_thread_new("status thread", &status_thr, cs);
+		ret = sync_local(cs, cs->target);
+		cs->is_readthread_finished = TRUE;
+		g_thread_join(status_thread);
+
+		return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
 	g_option_context_free(context);
 
 	cs->async_queue = g_async_queue_new();
@@ -329,30 +919,154 @@ int main(int argc, char *argv[])
 
 	cs->main_loop = g_main_loop_new(NULL, FALSE);
 
+	if (cs->is_server) {
+		if (cs->roll_state) {
+			cs->server->roll = roll_state_load(cs, cs->roll_state);
+
+			if (!cs->server->roll) {
+				g_error("Unable to use rolling state %s", cs->roll_state);
+			}
+		}
+
+		init_server(cs);
+	} else if (cs->time_budget) {
+		cs->deadline = start_time + (gint64) cs->time_budget * G_USEC_PER_SEC;
+	} else {
+		cs->cursor = 1;
+	}
+
+	cs->clients = g_ptr_array_new_with_free_func((GDestroyNotify) client_free);
+	client_threads = g_ptr_array_new();
+
+	if (!cs->is_server) {
+		gboolean offline = cs->patch_filename || cs->export_manifest;
+
+		/* Without --dest, the default IP is the one destination */
+		if (ip_given || (!cs->destinations && !offline)) {
+			g_ptr_array_add(cs->clients, client_new(cs, cs->server_ip));
+		}
+
+		for (gchar **dest = cs->destinations; dest && *dest; dest++) {
+			g_ptr_array_add(cs->clients, client_new(cs, *dest));
+		}
+
+		if (cs->patch_filename) {
+			g_ptr_array_add(cs->clients, client_new_file(cs, QC_DEST_PATCH,
+			                cs->patch_filename));
+		}
+
+		if (cs->export_manifest) {
+			g_ptr_array_add(cs->clients, client_new_file(cs, QC_DEST_MANIFEST,
+			                cs->export_manifest));
+		}
+
+		cs->active_workers = cs->clients->len;
+
+		for (guint i = 0; cs->change_map && i < cs->clients->len; i++) {
+			struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+			if (client->kind == QC_DEST_MANIFEST) {
+				continue;
+			}
+
+			/* One map per destination, verdicts may differ between them */
+			client->change_map = changemap_new(cs);
+			client->change_map_filename = i ? g_strdup_printf("%s.%u", cs->change_map, i) :
+			                              g_strdup(cs->change_map);
+			g_debug("Change map for %s: %s", client->name, client->change_map_filename);
+		}
+
+		for (guint i = 0; cs->history && i < cs->clients->len; i++) {
+			struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+			if (client->kind != QC_DEST_SERVER) {
+				continue;
+			}
+
+			/* Like change maps, one history per destination */
+			client->history_filename = i ? g_strdup_printf("%s.%u", cs->history, i) :
+			                           g_strdup(cs->history);
+			client->history = history_load(cs, client->history_filename);
+
+			if (!client->history) {
+				g_error("Unable to use history %s", client->history_filename);
+			}
+
+			if (cs->speculate) {
+				client->in_flight = g_queue_new();
+			}
+		}
+
+		for (guint i = 0; cs->plan && i < cs->clients->len; i++) {
+			struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+			client->plan = g_new0(struct plan_stats, 1);
+		}
+	}
+
 	reader_thread = g_thread_new("reader thread", &reader_thr, cs);
-	worker_thread = g_thread_new("worker thread", &worker_thr, cs);
+
+	if (cs->is_server) {
+		worker_thread = g_thread_new("worker thread", &worker_thr, cs);
+	}
+
+	for (guint i = 0; i < cs->clients->len; i++) {
+		struct cs_client *client = g_ptr_array_index(cs->clients, i);
+
+		g_debug("Destination: %s", client->name);
+		g_ptr_array_add(client_threads, g_thread_new("client worker thread",
+		                &client_worker_thr, client));
+	}
+
 	status_thread = g_thread_new("status thread", &status_thr, cs);
 
 	g_main_loop_run(cs->main_loop);
 
 	g_thread_join(reader_thread);
-	g_thread_join(worker_thread);
+
+	if (worker_thread) {
+		g_thread_join(worker_thread);
+	}
+
+	for (guint i = 0; i < client_threads->len; i++) {
+		g_thread_join(g_ptr_array_index(client_threads, i));
+	}
+
 	g_thread_join(status_thread);
 
+	/* Left over from a session that ended early */
+	while ((chnk = g_async_queue_try_pop(cs->async_queue))) {
+		chunk_unref(chnk);
+	}
+
 	g_async_queue_unref(cs->async_queue);
 
 	g_main_loop_unref(cs->main_loop);
 
-	deinit_client(cs);
+	for (guint i = 0; i < cs->clients->len; i++) {
+		deinit_client(g_ptr_array_index(cs->clients, i));
+	}
+
 	deinit_server(cs);
 
+	g_ptr_array_free(client_threads, TRUE);
+	g_ptr_array_free(cs->clients, TRUE);
+	g_strfreev(cs->destinations);
+	g_free(cs->chunk_mask);
+	dirty_blocks_free(cs->dirty);
+	manifest_free(cs->manifest);
+	roll_state_free(cs->server->roll);
+
 	g_mutex_clear(&cs->mutex);
 	g_mutex_clear(&cs->server->mutex);
 	g_cond_clear(&cs->cond);
 	g_cond_clear(&cs->server->cond);
-	g_free(cs->client);
+	g_cond_clear(&cs->server->session_cond);
 	g_free(cs->server);
+
+	/* A full plan doubles as consistency check */
+	ret = cs->plan_differs || cs->session_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 	g_free(cs);
 
-	return EXIT_SUCCESS;
+	return ret;
 }
@@ -9,6 +9,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <gio/gio.h>
@@ -19,29 +22,57 @@
 	#include <xxhash.h>
 #endif
 
-#define QC_WAIT_TIME            (32 * 1000) /* mS */
-#define QC_CHUNK_SIZE           (200 * 1000000UL) /* 200 MB */
-#define QC_MAX_READER_QUEUE     20
-#define QC_DEFAULT_SERVER_IP    "127.0.0.1"
-#define QC_DEFAULT_SERVER_PORT  12345
+#include "protocol.h"
 
-#define VERSION_LENGTH 32
+#define QC_WAIT_TIME            (32 * 1000) /* mS */
+#define QC_MAX_READER_QUEUE     20 /* chunks with data per destination */
+#define QC_MAX_CLIENT_LAG       1000 /* chunks queued per destination in total */
+#define QC_IO_BLOCK_SIZE        (4 * 1024 * 1024UL)
+#define QC_DIRECT_ALIGN         4096
+#define QC_PIPE_SIZE            (1024 * 1024) /* for splice */
+#define QC_MAX_SPECULATE        8 /* chunks sent ahead of their verdict */
+#define QC_MAX_SPEC_PENDING_SERVER 2 /* speculative chunks a server buffers by default */
 
 enum QCResponse {
 	QC_RESPONSE_ACK,
 	QC_RESPONSE_NOK,
-	QC_RESPONSE_EQL
+	QC_RESPONSE_EQL,
+	QC_RESPONSE_CPY,
+	QC_RESPONSE_RTY
 };
 
-#define QC_ACK_MESSAGE  "ACK"
-#define QC_NOK_MESSAGE  "NOK"
-#define QC_EQL_MESSAGE  "EQL"
+enum QCVerify {
+	QC_VERIFY_NONE,
+	QC_VERIFY_STREAM,	/* hash data while it is received */
+	QC_VERIFY_FULL		/* additionally read it back after writing */
+};
 
 struct chunk {
 	gint64 num;
 	XXH128_hash_t hash;
 	gsize size;
 	gchar *data;
+	gint ref_count;
+	gboolean partial;	/* data and hash cover only the dirty extents */
+};
+
+/* A byte range of the file, chunks with a dirty bitmap consist of several */
+struct extent {
+	off_t offset;
+	gsize size;
+};
+
+/* Dirty blocks of the whole file, both sides read only these */
+struct dirty_blocks {
+	guint64 block_size;
+	guint64 block_count;	/* blocks the file spans */
+	guint8 *bits;
+};
+
+struct index_entry {
+	XXH128_hash_t hash;
+	gsize size;
+	gboolean valid;
 };
 
 struct cs_server {
@@ -51,13 +82,62 @@ struct cs_server {
 	GMutex mutex;
 	gboolean update_current_finished;
 	GCond cond;
+	gboolean session_started;
+	gboolean session_finished;
+	GCond session_cond;
+	GMutex index_mutex;
+	GHashTable *index;	/* content hash -> chunk num */
+	struct index_entry *index_entries;
+	GAsyncQueue *verify_queue;
+	GThread *verify_thread;
+	guint64 verify_failures;
+	GHashTable *damaged;	/* chunk nums holding data that failed verification */
+	struct change_map *change_map;
+	struct roll_state *roll;
+	gchar *probe;		/* plan: network probe data, for the write probe */
+	guint64 probe_size;
+	GQueue *spec_pending;	/* speculative chunks received, not yet decided */
+	guint64 spec_budget;
+	guint64 chunks_handled;
+	gint64 last_num;
+};
+
+enum QCDestination {
+	QC_DEST_SERVER,
+	QC_DEST_PATCH,
+	QC_DEST_MANIFEST
 };
 
 struct cs_client {
+	struct cs_data *cs;
+	enum QCDestination kind;
+	gchar *name;
+	gchar *server_ip;
+	guint16 server_port;
 	GSocketClient *client;
 	GSocketConnection *connection;
 	GInputStream *input_stream;
 	GOutputStream *output_stream;
+	GAsyncQueue *async_queue;
+	gint window;		/* queued chunks still holding data */
+	FILE *fp;		/* re-reads chunks that fell out of the window */
+	guint64 chunks_reread;
+	FILE *out_fp;		/* patch file */
+	guint64 chunks_written;
+	gsize bytes_written;
+	struct manifest *manifest;	/* manifest being exported */
+	struct change_map *change_map;
+	gchar *change_map_filename;
+	struct plan_stats *plan;
+	struct history *history;
+	gchar *history_filename;
+	GQueue *in_flight;	/* speculative chunks waiting for their verdict */
+	guint64 spec_budget;	/* in-flight budget the server accepted */
+	guint64 spec_sent;
+	guint64 spec_dirty;
+	guint64 spec_resent;
+	gsize spec_wasted_bytes;
+	guint64 spec_missed;	/* dirty, but not predicted */
 };
 
 struct cs_data {
@@ -66,17 +146,73 @@ struct cs_data {
 	gboolean is_readthread_finished;
 	gchar *filename;
 	gsize filesize;
+	guint64 chunk_count;
+	guint8 *chunk_mask;	/* bit (num - 1) set: chunk takes part in session */
+	gchar *dirty_bitmap;
+	struct dirty_blocks *dirty;	/* NULL: chunks are read whole */
+	gboolean full_scan;
+	gboolean index_scan;	/* server: index the whole file before comparing */
+	gchar *manifest_filename;
+	struct manifest *manifest;	/* server content for --patch */
+	gchar *patch_filename;
+	gchar *export_manifest;
+	gchar *apply_patch;
+	gchar *target;
+	gchar *change_map;
+	gchar *heatmap;
+	gchar **remaining;
+	gchar *verify_mode;
+	enum QCVerify verify;
+	gint time_budget;	/* seconds, 0: no budget */
+	gint64 deadline;	/* no chunk is started after this */
+	gint budget_exhausted;	/* atomic, set once the deadline passed */
+	guint64 cursor;		/* chunk the session starts at, 0: not yet known */
+	gchar *roll_state;
+	gint stale_windows;
+	gboolean plan;
+	gdouble plan_margin;	/* percent, 0: compare all chunks */
+	guint64 plan_population;	/* selected chunks before sampling */
+	gsize plan_population_bytes;
+	gboolean plan_differs;
+	gboolean session_failed;	/* server: damaged data left on disk */
+	gchar *history;
+	gint speculate;		/* client: chunks in flight, 0: off; server: cap, 0: default */
 	gsize current_file_position;
 	gchar *server_ip;
 	guint16 server_port;
 	gboolean is_server;
-	struct cs_client *client;
+	gchar **destinations;
+	GPtrArray *clients;
+	gint active_workers;
 	struct cs_server *server;
 	GMutex mutex;
 	GCond cond;
 	gboolean server_one_chunk_finished;
-	gboolean misc_sent;
+	gint session_ended;	/* atomic, set under mutex to wake the worker */
 	gboolean misc_received;
 };
 
+XXH128_hash_t get_hash128(const void *buf, gsize size);
+XXH3_state_t *hash128_stream_new(void);
+void hash128_stream_update(XXH3_state_t *state, const void *buf, gsize size);
+XXH128_hash_t hash128_stream_finish(XXH3_state_t *state);
+gboolean are_hashes_equal(XXH128_hash_t hash1, XXH128_hash_t hash2);
+gint fwrite_le64(FILE *fp, guint64 val);
+gint fread_le64(FILE *fp, guint64 *val);
+gint fwrite_hash128(FILE *fp, XXH128_hash_t hash);
+gint fread_hash128(FILE *fp, XXH128_hash_t *hash);
+gint save_atomically(const gchar *filename, const gchar *what,
+                     gint (*writer)(FILE *fp, gpointer data), gpointer data);
+gint copy_range(gint src_fd, off_t src_offset, gint dst_fd, off_t dst_offset,
+                gsize size);
+struct chunk *chunk_ref(struct chunk *chnk);
+void chunk_unref(struct chunk *chnk);
+guint8 *chunk_mask_new(guint64 chunk_count);
+void chunk_mask_clear(guint8 *mask, gint64 num);
+gboolean chunk_is_selected(struct cs_data *cs, gint64 num);
+guint64 chunk_mask_count(struct cs_data *cs);
+gint64 chunk_at(struct cs_data *cs, guint64 pos);
+gboolean budget_used_up(struct cs_data *cs);
+gdouble reader_throughput(void);
+
 #endif //QUICKCHUNK_QUICKCHUNK_H
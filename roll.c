@@ -0,0 +1,172 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#include "roll.h"
+
+/* A missing state file starts the rotation at the first chunk */
+struct roll_state *roll_state_load(struct cs_data *cs, const gchar *filename)
+{
+	struct roll_state *roll;
+	gchar magic[sizeof(QC_ROLL_MAGIC) - 1];
+	guint64 chunk_size, filesize;
+	FILE *fp;
+
+	roll = g_new0(struct roll_state, 1);
+	roll->chunk_count = cs->chunk_count;
+	roll->filesize = cs->filesize;
+	roll->cursor = 1;
+	roll->last_window = g_new0(guint64, cs->chunk_count);
+
+	fp = g_fopen(filename, "r");
+
+	if (!fp) {
+		g_message("No rolling state in %s yet, starting at the first chunk", filename);
+		return roll;
+	}
+
+	if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+	    memcmp(magic, QC_ROLL_MAGIC, sizeof(magic)) != 0 ||
+	    fread_le64(fp, &chunk_size) || fread_le64(fp, &filesize) ||
+	    fread_le64(fp, &roll->chunk_count) ||
+	    fread_le64(fp, &roll->window) || fread_le64(fp, &roll->cursor)) {
+		g_critical("%s is no rolling state", filename);
+		goto err;
+	}
+
+	if (chunk_size != QC_CHUNK_SIZE || filesize != cs->filesize ||
+	    roll->chunk_count != cs->chunk_count ||
+	    !roll->cursor || roll->cursor > MAX(roll->chunk_count, 1)) {
+		g_critical("Rolling state %s belongs to a different file", filename);
+		goto err;
+	}
+
+	for (guint64 i = 0; i < roll->chunk_count; i++) {
+		if (fread_le64(fp, &roll->last_window[i])) {
+			g_critical("Rolling state %s is truncated", filename);
+			goto err;
+		}
+	}
+
+	fclose(fp);
+
+	g_debug("Rolling state %s: %" G_GUINT64_FORMAT " windows, cursor at chunk %"
+	        G_GUINT64_FORMAT, filename, roll->window, roll->cursor);
+
+	return roll;
+
+err:
+	fclose(fp);
+	roll_state_free(roll);
+
+	return NULL;
+}
+
+static gint roll_state_write(FILE *fp, gpointer data)
+{
+	struct roll_state *roll = data;
+
+	if (fwrite(QC_ROLL_MAGIC, strlen(QC_ROLL_MAGIC), 1, fp) != 1 ||
+	    fwrite_le64(fp, QC_CHUNK_SIZE) ||
+	    fwrite_le64(fp, roll->filesize) ||
+	    fwrite_le64(fp, roll->chunk_count) ||
+	    fwrite_le64(fp, roll->window) ||
+	    fwrite_le64(fp, roll->cursor)) {
+		return -1;
+	}
+
+	for (guint64 i = 0; i < roll->chunk_count; i++) {
+		if (fwrite_le64(fp, roll->last_window[i])) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* An interrupted session leaves the state of the previous window intact */
+gint roll_state_save(struct roll_state *roll, const gchar *filename)
+{
+	return save_atomically(filename, "rolling state", roll_state_write, roll);
+}
+
+/*
+ * Record a finished window. Chunks are visited in rotation order from the
+ * cursor on, and the client stops at a chunk boundary, so the chunks handled
+ * form a prefix of that order. A session that handled every selected chunk
+ * covered the whole file.
+ */
+void roll_state_commit(struct roll_state *roll, struct cs_data *cs,
+                       guint64 chunks_handled, gint64 last_num)
+{
+	guint64 covered = 0;
+
+	roll->window++;
+
+	if (chunks_handled == chunk_mask_count(cs)) {
+		covered = roll->chunk_count;
+	} else if (chunks_handled) {
+		covered = (last_num - roll->cursor + roll->chunk_count) % roll->chunk_count
+		          + 1;
+		roll->cursor = last_num % roll->chunk_count + 1;
+	}
+
+	for (guint64 pos = 1; pos <= covered; pos++) {
+		roll->last_window[chunk_at(cs, pos) - 1] = roll->window;
+	}
+
+	g_message("Window %" G_GUINT64_FORMAT " covered %" G_GUINT64_FORMAT " of %"
+	          G_GUINT64_FORMAT " chunks, next window starts at chunk %"
+	          G_GUINT64_FORMAT, roll->window, covered, roll->chunk_count, roll->cursor);
+}
+
+/*
+ * Report the ranges not synced within the last stale_windows windows, one line
+ * per run of chunks last synced in the same window.
+ */
+void roll_state_report(struct roll_state *roll, guint64 stale_windows)
+{
+	guint64 first = 0, ranges = 0;
+
+	for (guint64 num = 1; num <= roll->chunk_count + 1; num++) {
+		/* Chunks never synced are stale from the first window on */
+		gboolean stale = num <= roll->chunk_count &&
+		                 (!roll->last_window[num - 1] ||
+		                  roll->window - roll->last_window[num - 1] >= stale_windows);
+
+		if (first && (!stale ||
+		              roll->last_window[num - 1] != roll->last_window[first - 1])) {
+			guint64 last_window = roll->last_window[first - 1];
+			gchar *when = last_window ? g_strdup_printf("in window %" G_GUINT64_FORMAT,
+			              last_window) : g_strdup("never");
+
+			g_message("Stale: chunks %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT
+			          " (bytes %" G_GUINT64_FORMAT "-%" G_GUINT64_FORMAT "), synced %s",
+			          first, num - 1, (first - 1) * QC_CHUNK_SIZE,
+			          MIN((num - 1) * QC_CHUNK_SIZE, roll->filesize), when);
+			g_free(when);
+			first = 0;
+			ranges++;
+		}
+
+		if (stale && !first) {
+			first = num;
+		}
+	}
+
+	if (!ranges) {
+		g_message("All chunks synced within the last %" G_GUINT64_FORMAT " windows",
+		          stale_windows);
+	}
+}
+
+void roll_state_free(struct roll_state *roll)
+{
+	if (!roll) {
+		return;
+	}
+
+	g_free(roll->last_window);
+	g_free(roll);
+}
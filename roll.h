@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Copyright (C) 2023, Christoph Fritz <chf.fritz@googlemail.com>
+ */
+
+#ifndef QUICKCHUNK_ROLL_H
+#define QUICKCHUNK_ROLL_H
+
+#include "quickchunk.h"
+
+/*
+ * Rolling state of a server file, kept across time-budgeted sessions (windows),
+ * all integers little endian:
+ *
+ *   8 bytes   magic "QCROLL01"
+ *   8 bytes   chunk size
+ *   8 bytes   file size
+ *   8 bytes   number of chunks
+ *   8 bytes   number of committed windows
+ *   8 bytes   cursor, chunk number the next window starts at
+ *
+ * followed by one 8 byte record per chunk: the window it was last synced in,
+ * 0 if never.
+ */
+#define QC_ROLL_MAGIC   "QCROLL01"
+
+struct roll_state {
+	guint64 chunk_count;
+	gsize filesize;
+	guint64 window;
+	guint64 cursor;
+	guint64 *last_window;
+};
+
+struct roll_state *roll_state_load(struct cs_data *cs, const gchar *filename);
+gint roll_state_save(struct roll_state *roll, const gchar *filename);
+void roll_state_commit(struct roll_state *roll, struct cs_data *cs,
+                       guint64 chunks_handled, gint64 last_num);
+void roll_state_report(struct roll_state *roll, guint64 stale_windows);
+void roll_state_free(struct roll_state *roll);
+
+#endif //QUICKCHUNK_ROLL_H
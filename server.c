@@ -4,10 +4,706 @@
  */
 
 #include "server.h"
+#include "bitmap.h"
+#include "changemap.h"
+#include "roll.h"
+#include "plan.h"
 
-static gboolean are_hashes_equal(XXH128_hash_t hash1, XXH128_hash_t hash2)
+static guint hash128_hash(gconstpointer key)
 {
-	return (hash1.low64 == hash2.low64) && (hash1.high64 == hash2.high64);
+	const XXH128_hash_t *hash = key;
+
+	return (guint)(hash->low64 ^ hash->high64);
+}
+
+static gboolean hash128_equal(gconstpointer a, gconstpointer b)
+{
+	return are_hashes_equal(*(const XXH128_hash_t *)a, *(const XXH128_hash_t *)b);
+}
+
+/*
+ * The index maps the hash of every chunk whose current content on disk is
+ * known to its chunk number. A chunk is removed before it gets overwritten,
+ * so a lookup only ever returns content that is still intact.
+ */
+void server_index_add(struct cs_data *cs, gint64 num, XXH128_hash_t hash,
+                      gsize size)
+{
+	struct index_entry *entry = &cs->server->index_entries[num];
+
+	g_mutex_lock(&cs->server->index_mutex);
+	entry->hash = hash;
+	entry->size = size;
+	entry->valid = TRUE;
+	g_hash_table_replace(cs->server->index, &entry->hash, GUINT_TO_POINTER(num));
+	g_mutex_unlock(&cs->server->index_mutex);
+}
+
+static void server_index_remove(struct cs_data *cs, gint64 num)
+{
+	struct index_entry *entry = &cs->server->index_entries[num];
+
+	g_mutex_lock(&cs->server->index_mutex);
+
+	if (entry->valid) {
+		/* A later duplicate may have taken over the key */
+		if (GPOINTER_TO_UINT(g_hash_table_lookup(cs->server->index,
+		                     &entry->hash)) == num) {
+			g_hash_table_remove(cs->server->index, &entry->hash);
+		}
+
+		entry->valid = FALSE;
+	}
+
+	g_mutex_unlock(&cs->server->index_mutex);
+}
+
+static gint64 server_index_lookup(struct cs_data *cs, XXH128_hash_t hash,
+                                  gsize size)
+{
+	gint64 num;
+
+	g_mutex_lock(&cs->server->index_mutex);
+	num = GPOINTER_TO_UINT(g_hash_table_lookup(cs->server->index, &hash));
+
+	if (num && (!cs->server->index_entries[num].valid ||
+	            cs->server->index_entries[num].size != size)) {
+		num = 0;
+	}
+
+	g_mutex_unlock(&cs->server->index_mutex);
+
+	return num;
+}
+
+/*
+ * Hash the whole file up front, so content found at a later position is known
+ * as well, not only what the reader has seen so far. Costs one extra read of
+ * the file before the first verdict.
+ */
+void server_index_scan(struct cs_data *cs, FILE *fp)
+{
+	gchar *buf = g_malloc(QC_CHUNK_SIZE);
+	gint64 start_time = g_get_monotonic_time();
+
+	for (guint64 num = 1; num <= cs->chunk_count; num++) {
+		off_t offset = (off_t)(num - 1) * QC_CHUNK_SIZE;
+		gsize size = MIN(QC_CHUNK_SIZE, cs->filesize - offset);
+
+		if (fseeko(fp, offset, SEEK_SET) || fread(buf, 1, size, fp) != size) {
+			g_error("Failed to read chunk %" G_GUINT64_FORMAT " for the index", num);
+		}
+
+		server_index_add(cs, num, get_hash128(buf, size), size);
+	}
+
+	g_free(buf);
+
+	g_message("Indexed %" G_GUINT64_FORMAT " chunks in %.2lf seconds", cs->chunk_count,
+	          (g_get_monotonic_time() - start_time) / 1e6);
+}
+
+/*
+ * Copy one chunk within the file. Source and destination are distinct chunks,
+ * so the ranges never overlap.
+ */
+static gint copy_chunk(FILE *fp, gint64 src_num, gint64 dst_num, gsize size)
+{
+	gint fd = fileno(fp);
+
+	/* Pending stdio writes must hit the file before the kernel copies */
+	fflush(fp);
+
+	return copy_range(fd, (off_t)(src_num - 1) * QC_CHUNK_SIZE, fd,
+	                  (off_t)(dst_num - 1) * QC_CHUNK_SIZE, size);
+}
+
+/* Per connection state of the receive path */
+struct receive_ctx {
+	GSocket *socket;
+	GInputStream *input_stream;
+	gint fd;		/* target file */
+	gint pipe_fds[2];	/* socket -> file, -1 if splice is not available */
+	gint tee_fds[2];	/* duplicate of the data for hashing */
+	gsize pipe_size;
+};
+
+static void receive_ctx_init(struct cs_data *cs, struct receive_ctx *rx,
+                             GSocketConnection *connection, FILE *fp)
+{
+	gint size;
+
+	rx->socket = g_socket_connection_get_socket(connection);
+	rx->input_stream = g_io_stream_get_input_stream(G_IO_STREAM(connection));
+	rx->fd = fileno(fp);
+	rx->pipe_fds[0] = rx->pipe_fds[1] = -1;
+	rx->tee_fds[0] = rx->tee_fds[1] = -1;
+
+	if (pipe2(rx->pipe_fds, O_CLOEXEC) ||
+	    (cs->verify != QC_VERIFY_NONE && pipe2(rx->tee_fds, O_CLOEXEC))) {
+		g_warning("No pipe for splice (%s), copying received data through user space",
+		          g_strerror(errno));
+		return;
+	}
+
+	/* Larger pipes mean fewer syscalls, the default is only 64 KiB */
+	fcntl(rx->pipe_fds[1], F_SETPIPE_SZ, QC_PIPE_SIZE);
+	size = fcntl(rx->pipe_fds[1], F_GETPIPE_SZ);
+
+	if (rx->tee_fds[1] >= 0) {
+		/* tee() duplicates at most what fits into the second pipe */
+		fcntl(rx->tee_fds[1], F_SETPIPE_SZ, size);
+		size = MIN(size, fcntl(rx->tee_fds[1], F_GETPIPE_SZ));
+	}
+
+	rx->pipe_size = size > 0 ? size : 0;
+}
+
+static void receive_ctx_clear(struct receive_ctx *rx)
+{
+	for (gint i = 0; i < 2; i++) {
+		if (rx->pipe_fds[i] >= 0) {
+			close(rx->pipe_fds[i]);
+		}
+
+		if (rx->tee_fds[i] >= 0) {
+			close(rx->tee_fds[i]);
+		}
+	}
+}
+
+/*
+ * Receive the chunk data in blocks and write every block right away to its
+ * extent, hashing it on the way. Returns FALSE if the data does not match the
+ * announced hash.
+ */
+static gboolean receive_chunk_copy(struct cs_data *cs, struct receive_ctx *rx,
+                                   FILE *fp, struct chunk *chnk, GArray *extents)
+{
+	XXH3_state_t *state = NULL;
+	gsize remaining;
+	gsize bytes_read, len;
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	gchar *buf;
+
+	if (cs->verify != QC_VERIFY_NONE) {
+		state = hash128_stream_new();
+	}
+
+	buf = g_malloc(QC_IO_BLOCK_SIZE);
+
+	for (guint i = 0; i < extents->len; i++) {
+		struct extent *ext = &g_array_index(extents, struct extent, i);
+
+		if (fseeko(fp, ext->offset, SEEK_SET)) {
+			g_error("Failed to seek to chunk %" G_GINT64_FORMAT, chnk->num);
+		}
+
+		for (remaining = ext->size; remaining; remaining -= len) {
+			len = MIN(remaining, QC_IO_BLOCK_SIZE);
+
+			if (!g_input_stream_read_all(rx->input_stream, buf, len, &bytes_read, NULL,
+			                             &error)) {
+				g_error("Error reading chunk data: %s", error->message);
+			}
+
+			if (bytes_read != len) {
+				g_error("ERROR: bytes_read %zu unequal to expected %zu", bytes_read, len);
+			}
+
+			if (state) {
+				hash128_stream_update(state, buf, len);
+			}
+
+			if (fwrite(buf, 1, len, fp) != len) {
+				g_error("Fail to write %" G_GSIZE_FORMAT " bytes", len);
+			}
+		}
+	}
+
+	g_free(buf);
+
+	if (state) {
+		ok = are_hashes_equal(hash128_stream_finish(state), chnk->hash);
+	}
+
+	return ok;
+}
+
+/* Move len bytes from the pipe into the file, through user space if need be */
+static void pipe_to_file(struct receive_ctx *rx, loff_t *offset, gsize len,
+                         gchar *buf)
+{
+	ssize_t n;
+
+	while (len) {
+		n = splice(rx->pipe_fds[0], NULL, rx->fd, offset, len, SPLICE_F_MOVE);
+
+		if (n < 0 && errno == EINVAL) {
+			/* The filesystem does not support splice */
+			n = read(rx->pipe_fds[0], buf, MIN(len, QC_IO_BLOCK_SIZE));
+
+			if (n > 0 && pwrite(rx->fd, buf, n, *offset) != n) {
+				n = -1;
+			}
+
+			if (n > 0) {
+				*offset += n;
+			}
+		}
+
+		if (n <= 0) {
+			g_error("Fail to write %" G_GSIZE_FORMAT " bytes: %s", len,
+			        g_strerror(errno));
+		}
+
+		len -= n;
+	}
+}
+
+/* Hash len bytes of the pipe content by way of a duplicate, without consuming */
+static gsize pipe_hash(struct receive_ctx *rx, XXH3_state_t *state, gsize len,
+                       gchar *buf)
+{
+	ssize_t teed, n;
+
+	teed = tee(rx->pipe_fds[0], rx->tee_fds[1], len, 0);
+
+	if (teed <= 0) {
+		g_error("Failed to duplicate received data: %s", g_strerror(errno));
+	}
+
+	for (gsize left = teed; left; left -= n) {
+		n = read(rx->tee_fds[0], buf, MIN(left, QC_IO_BLOCK_SIZE));
+
+		if (n <= 0) {
+			g_error("Failed to read duplicated data: %s", g_strerror(errno));
+		}
+
+		hash128_stream_update(state, buf, n);
+	}
+
+	return teed;
+}
+
+/*
+ * Zero-copy counterpart of receive_chunk_copy(): splice the data from the
+ * socket through a pipe into the file, so it never passes through user space.
+ * Only for verification, tee() duplicates the pipe pages and the hash reads
+ * the duplicate, which costs one copy instead of two.
+ */
+static gboolean receive_chunk_spliced(struct cs_data *cs, struct receive_ctx *rx,
+                                      FILE *fp, struct chunk *chnk, GArray *extents)
+{
+	gint sock_fd = g_socket_get_fd(rx->socket);
+	XXH3_state_t *state = NULL;
+	gsize remaining;
+	loff_t offset;
+	GError *error = NULL;
+	gboolean ok = TRUE;
+	gchar *buf;
+	ssize_t n;
+
+	if (cs->verify != QC_VERIFY_NONE) {
+		state = hash128_stream_new();
+	}
+
+	buf = g_malloc(QC_IO_BLOCK_SIZE);
+
+	/* Pending stdio writes must not land on top of spliced data */
+	fflush(fp);
+
+	/* A splice never crosses an extent, the pipe is empty at its end */
+	for (guint i = 0; i < extents->len; i++) {
+		offset = g_array_index(extents, struct extent, i).offset;
+		remaining = g_array_index(extents, struct extent, i).size;
+
+		while (remaining) {
+			n = splice(sock_fd, NULL, rx->pipe_fds[1], NULL,
+			           MIN(remaining, rx->pipe_size), SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (n < 0 && errno == EAGAIN) {
+				/* GSocket keeps its fd non-blocking */
+				if (!g_socket_condition_wait(rx->socket, G_IO_IN, NULL, &error)) {
+					g_error("Error reading chunk data: %s", error->message);
+				}
+
+				continue;
+			}
+
+			if (n <= 0) {
+				g_error("Error reading chunk data: %s", n ? g_strerror(errno) :
+				        "connection closed");
+			}
+
+			remaining -= n;
+
+			while (n) {
+				gsize len = state ? pipe_hash(rx, state, n, buf) : (gsize) n;
+
+				pipe_to_file(rx, &offset, len, buf);
+				n -= len;
+			}
+		}
+	}
+
+	g_free(buf);
+
+	if (state) {
+		ok = are_hashes_equal(hash128_stream_finish(state), chnk->hash);
+	}
+
+	return ok;
+}
+
+static gboolean receive_chunk(struct cs_data *cs, struct receive_ctx *rx,
+                              FILE *fp, struct chunk *chnk)
+{
+	gboolean partial, ok;
+	GArray *extents = chunk_extents(cs, chnk->num, &partial);
+
+	if (rx->pipe_size) {
+		ok = receive_chunk_spliced(cs, rx, fp, chnk, extents);
+	} else {
+		ok = receive_chunk_copy(cs, rx, fp, chnk, extents);
+	}
+
+	g_array_free(extents, TRUE);
+
+	return ok;
+}
+
+/*
+ * Read written chunks back from disk, bypassing the page cache. O_DIRECT needs
+ * aligned offsets, so reads start at the block boundary before each extent.
+ */
+static gboolean verify_chunk_on_disk(struct cs_data *cs, gint fd, gchar *buf,
+                                     struct chunk *chnk)
+{
+	gboolean partial;
+	GArray *extents = chunk_extents(cs, chnk->num, &partial);
+	XXH3_state_t *state = hash128_stream_new();
+	ssize_t n;
+
+	for (guint i = 0; i < extents->len; i++) {
+		off_t offset = g_array_index(extents, struct extent, i).offset;
+		off_t pos = offset & ~(off_t)(QC_DIRECT_ALIGN - 1);
+		gsize skip = offset - pos;
+		gsize remaining = g_array_index(extents, struct extent, i).size;
+
+		while (remaining) {
+			n = pread(fd, buf, QC_IO_BLOCK_SIZE, pos);
+
+			if (n <= (ssize_t)skip) {
+				g_critical("Failed to read back chunk %" G_GINT64_FORMAT ": %s",
+				           chnk->num, n < 0 ? g_strerror(errno) : "short read");
+				hash128_stream_finish(state);
+				g_array_free(extents, TRUE);
+				return FALSE;
+			}
+
+			gsize len = MIN(remaining, n - skip);
+
+			hash128_stream_update(state, buf + skip, len);
+			remaining -= len;
+			pos += n;
+			skip = 0;
+		}
+	}
+
+	g_array_free(extents, TRUE);
+
+	return are_hashes_equal(hash128_stream_finish(state), chnk->hash);
+}
+
+static void *verify_thr(void *data)
+{
+	struct cs_data *cs = (struct cs_data *) data;
+	struct chunk *chnk;
+	gchar *buf;
+	gint fd;
+
+	fd = open(cs->filename, O_RDONLY | O_DIRECT);
+
+	if (fd < 0) {
+		g_warning("O_DIRECT not available (%s), read-after-write check may hit the page cache",
+		          g_strerror(errno));
+		fd = open(cs->filename, O_RDONLY);
+
+		if (fd < 0) {
+			g_error("Unable to open file <%s>: %s", __func__, cs->filename);
+		}
+	}
+
+	if (posix_memalign((void **)&buf, QC_DIRECT_ALIGN, QC_IO_BLOCK_SIZE)) {
+		g_error("Unable to allocate aligned buffer");
+	}
+
+	while ((chnk = g_async_queue_pop(cs->server->verify_queue))->num > 0) {
+		if (verify_chunk_on_disk(cs, fd, buf, chnk)) {
+			g_debug("Chunk %" G_GINT64_FORMAT " verified on disk", chnk->num);
+		} else {
+			g_critical("Chunk %" G_GINT64_FORMAT " differs on disk after writing",
+			           chnk->num);
+			cs->server->verify_failures++;
+		}
+
+		g_free(chnk);
+	}
+
+	g_free(chnk);
+	free(buf);
+	close(fd);
+
+	return NULL;
+}
+
+/* Hand a written chunk to the verifier, which trails the write cursor */
+static void verify_queue_push(struct cs_data *cs, FILE *fp, struct chunk *chnk)
+{
+	struct chunk *written = g_new0(struct chunk, 1);
+
+	/* Let the verifier see the data, it does not use our stdio buffer */
+	fflush(fp);
+
+	while (g_async_queue_length(cs->server->verify_queue) >= QC_MAX_READER_QUEUE) {
+		g_usleep(QC_WAIT_TIME);
+	}
+
+	written->num = chnk->num;
+	written->size = chnk->size;
+	written->hash = chnk->hash;
+	g_async_queue_push(cs->server->verify_queue, written);
+}
+
+/* Name the chunks whose data on disk failed verification and was not redone */
+static void report_damaged(struct cs_data *cs)
+{
+	GHashTableIter iter;
+	gpointer key;
+
+	g_hash_table_iter_init(&iter, cs->server->damaged);
+
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		guint64 num = GPOINTER_TO_UINT(key);
+
+		g_critical("Chunk %" G_GUINT64_FORMAT " (bytes %" G_GUINT64_FORMAT " to %"
+		           G_GUINT64_FORMAT ") of %s holds damaged data", num,
+		           (num - 1) * QC_CHUNK_SIZE, MIN(num * QC_CHUNK_SIZE, cs->filesize) - 1,
+		           cs->filename);
+	}
+}
+
+static void send_message(GOutputStream *output_stream, const gchar *msg)
+{
+	gsize bytes_written;
+	GError *error = NULL;
+
+	if (!g_output_stream_write_all(output_stream, msg, strlen(msg),
+	                               &bytes_written, NULL, &error)) {
+		g_error("Error sending %s: %s", msg, error->message);
+	}
+}
+
+/* Block until the worker hashed the local chunk the client is talking about */
+static XXH128_hash_t wait_for_current(struct cs_data *cs, gint64 num)
+{
+	XXH128_hash_t current_hash;
+	gint64 current_num;
+
+	g_mutex_lock(&cs->server->mutex);
+	g_debug("server: waiting for worker_thr to update current variables");
+
+	while (!cs->server->update_current_finished) {
+		//Mutex is released while waiting, and locked again before returning
+		g_cond_wait(&cs->server->cond, &cs->server->mutex);
+	}
+
+	g_debug("server: waiting finished");
+	cs->server->update_current_finished = FALSE;
+	current_num = cs->server->current_num;
+	current_hash = cs->server->current_hash;
+	g_mutex_unlock(&cs->server->mutex);
+
+	if (num != current_num) {
+		g_error("Sync issue: chnk->num (%" G_GINT64_FORMAT
+		        ") is unequal to current_num %" G_GINT64_FORMAT,
+		        num, current_num);
+	}
+
+	return current_hash;
+}
+
+/* Record the outcome of a chunk and let the worker move on to the next one */
+static void chunk_finished(struct cs_data *cs, struct chunk *chnk,
+                           enum QCChange state)
+{
+	if (cs->server->change_map) {
+		changemap_set(cs->server->change_map, chnk, state);
+	}
+
+	cs->server->chunks_handled++;
+	cs->server->last_num = chnk->num;
+
+	g_mutex_lock(&cs->mutex);
+	cs->server_one_chunk_finished = TRUE;
+	g_cond_signal(&cs->cond);
+	g_mutex_unlock(&cs->mutex);
+}
+
+/* A chunk whose data arrived ahead of its verdict */
+struct spec_chunk {
+	struct chunk chnk;
+	gboolean intact;
+};
+
+/*
+ * Speculative data has to wait in memory until the worker caught up with its
+ * chunk, it must not overwrite content the comparison has not seen yet.
+ */
+static void receive_speculative(struct cs_data *cs, GInputStream *input_stream,
+                                struct chunk *chnk)
+{
+	struct spec_chunk *spec = g_new0(struct spec_chunk, 1);
+	gsize bytes_read;
+	GError *error = NULL;
+
+	spec->chnk = *chnk;
+	spec->chnk.data = g_malloc(chnk->size);
+
+	if (!g_input_stream_read_all(input_stream, spec->chnk.data, chnk->size,
+	                             &bytes_read, NULL, &error)) {
+		g_error("Error reading speculative chunk data: %s", error->message);
+	}
+
+	if (bytes_read != chnk->size) {
+		g_error("ERROR: bytes_read %zu unequal to expected %zu", bytes_read,
+		        chnk->size);
+	}
+
+	spec->intact = cs->verify == QC_VERIFY_NONE ||
+	               are_hashes_equal(get_hash128(spec->chnk.data, chnk->size),
+	                                chnk->hash);
+
+	g_queue_push_tail(cs->server->spec_pending, spec);
+}
+
+static void write_chunk_data(struct cs_data *cs, FILE *fp, struct chunk *chnk)
+{
+	gboolean partial;
+	GArray *extents = chunk_extents(cs, chnk->num, &partial);
+	const gchar *data = chnk->data;
+	gint fd = fileno(fp);
+	ssize_t n;
+
+	/* Pending stdio writes must not land on top of this data */
+	fflush(fp);
+
+	for (guint i = 0; i < extents->len; i++) {
+		struct extent *ext = &g_array_index(extents, struct extent, i);
+
+		for (gsize written = 0; written < ext->size; written += n) {
+			n = pwrite(fd, data + written, ext->size - written, ext->offset + written);
+
+			if (n <= 0) {
+				g_error("Fail to write %" G_GSIZE_FORMAT " bytes: %s", chnk->size,
+				        g_strerror(errno));
+			}
+		}
+
+		data += ext->size;
+	}
+
+	g_array_free(extents, TRUE);
+}
+
+/*
+ * Decide on the oldest speculative chunk: EQL drops the data, ACK writes it,
+ * RTY asks for it again, the client answers with a resend record.
+ */
+static void resolve_speculative(struct cs_data *cs, FILE *fp,
+                                GOutputStream *output_stream)
+{
+	struct spec_chunk *spec = g_queue_pop_head(cs->server->spec_pending);
+	struct chunk *chnk = &spec->chnk;
+	XXH128_hash_t current_hash = wait_for_current(cs, chnk->num);
+	enum QCChange state = QC_CHANGE_DIRTY;
+
+	if (are_hashes_equal(current_hash, chnk->hash)) {
+		g_debug("Speculative chunk %" G_GINT64_FORMAT " is equal, data dropped",
+		        chnk->num);
+		send_message(output_stream, QC_EQL_MESSAGE);
+		state = QC_CHANGE_EQUAL;
+	} else if (!spec->intact) {
+		g_warning("Speculative chunk %" G_GINT64_FORMAT
+		          " arrived damaged, requesting it again", chnk->num);
+		send_message(output_stream, QC_RTY_MESSAGE);
+	} else {
+		server_index_remove(cs, chnk->num);
+		write_chunk_data(cs, fp, chnk);
+
+		/* The index only knows whole chunks */
+		if (!chnk->partial) {
+			server_index_add(cs, chnk->num, chnk->hash, chnk->size);
+		}
+
+		if (cs->verify == QC_VERIFY_FULL) {
+			verify_queue_push(cs, fp, chnk);
+		}
+
+		send_message(output_stream, QC_ACK_MESSAGE);
+	}
+
+	chunk_finished(cs, chnk, state);
+
+	g_free(chnk->data);
+	g_free(spec);
+}
+
+static void resolve_all_speculative(struct cs_data *cs, FILE *fp,
+                                    GOutputStream *output_stream)
+{
+	while (cs->server->spec_pending &&
+	       !g_queue_is_empty(cs->server->spec_pending)) {
+		resolve_speculative(cs, fp, output_stream);
+	}
+}
+
+/* The client's dirty blocks, the reader hashes only these from now on */
+static void receive_dirty_blocks(struct cs_data *cs, GInputStream *input_stream)
+{
+	guint64 blocks[2];
+	gsize bytes_read;
+	GError *error = NULL;
+
+	if (!g_input_stream_read_all(input_stream, blocks, sizeof(blocks), &bytes_read,
+	                             NULL, &error)) {
+		g_error("Error reading dirty block size: %s", error->message);
+	}
+
+	/* Bounded by the file size, before anything gets allocated */
+	if (bytes_read != sizeof(blocks) || blocks[0] < QC_MIN_DIRTY_BLOCK ||
+	    blocks[1] != (cs->filesize + blocks[0] - 1) / blocks[0]) {
+		g_error("protocol error: dirty blocks of %" G_GUINT64_FORMAT " bytes, %"
+		        G_GUINT64_FORMAT " of them", blocks[0], blocks[1]);
+	}
+
+	cs->dirty = dirty_blocks_new(blocks[0], cs->filesize);
+
+	if (!g_input_stream_read_all(input_stream, cs->dirty->bits,
+	                             QC_MASK_BYTES(cs->dirty->block_count), &bytes_read,
+	                             NULL, &error)) {
+		g_error("Error reading dirty blocks: %s", error->message);
+	}
+
+	if (bytes_read != QC_MASK_BYTES(cs->dirty->block_count)) {
+		g_error("protocol error: bytes_read(%zu) unequal to expected %" G_GUINT64_FORMAT,
+		        bytes_read, QC_MASK_BYTES(cs->dirty->block_count));
+	}
+
+	g_message("Partial session, reading only the dirty %" G_GUINT64_FORMAT
+	          " byte blocks", cs->dirty->block_size);
 }
 
 static gboolean
@@ -24,11 +720,18 @@ on_incoming_connection(GThreadedSocketService *self,
 	gsize bytes_read, bytes_written;
 	struct chunk *chnk;
 	GError *error = NULL;
-	size_t fw_nb;
-	long offset = 0;
-	gsize remote_filesize;
-	gint64 current_num;
+	long offset;
+	gint retries;
+	gboolean intact;
+	gboolean failed;
 	XXH128_hash_t current_hash;
+	gint64 src_num;
+	enum QCChange state;
+	guint64 chunks_copied = 0;
+	guint64 session_flags = 0;
+	guint64 chunk_flags;
+	GArray *extents;
+	struct receive_ctx rx;
 
 	chnk = g_new0(struct chunk, 1);
 
@@ -38,64 +741,149 @@ on_incoming_connection(GThreadedSocketService *self,
 		g_error("Failed to open fp for writing");
 	}
 
-	while (TRUE) {
-		g_mutex_lock(&cs->server->mutex);
-		g_debug("server: waiting for worker_thr to update current variables");
+	receive_ctx_init(cs, &rx, connection, fp);
+
+	if (cs->change_map) {
+		cs->server->change_map = changemap_new(cs);
+	}
 
-		while (!cs->server->update_current_finished) {
-			//Mutex is released while waiting, and locked again before returning
-			g_cond_wait(&cs->server->cond, &cs->server->mutex);
+	if (cs->verify == QC_VERIFY_FULL) {
+		cs->server->verify_queue = g_async_queue_new();
+		cs->server->verify_thread = g_thread_new("verify thread", &verify_thr, cs);
+	}
+
+	if (!cs->misc_received) {
+		// Read version, filesize and chunk count
+		guint8 preamble[QC_PREAMBLE_SIZE];
+		struct qc_preamble pre;
+
+		if (!g_input_stream_read_all(input_stream, preamble, sizeof(preamble),
+		                             &bytes_read, NULL, &error)) {
+			g_error("Error reading session header: %s", error->message);
 		}
 
-		g_debug("server: waiting finished");
-		cs->server->update_current_finished = FALSE;
-		current_num = cs->server->current_num;
-		current_hash = cs->server->current_hash;
-		g_mutex_unlock(&cs->server->mutex);
+		if (bytes_read != sizeof(preamble)) {
+			g_error("protocol error: bytes_read(%zu) unequal to expected %zu", bytes_read,
+			        sizeof(preamble));
+		}
 
-		if (!cs->misc_received) {
-			// Read version
-			gchar version_str[VERSION_LENGTH];
+		qc_preamble_decode(preamble, &pre);
+		g_debug("Received version: %s", pre.version);
 
-			if (g_input_stream_read_all(input_stream, version_str,
-			                            VERSION_LENGTH,
-			                            &bytes_read, NULL,
-			                            &error)) {
-				g_debug("Received version: %s", version_str);
+		if (strcmp(pre.version, PROJECT_VERSION) != 0) {
+			g_error("Version mismatch: client version %s, server version %s",
+			        pre.version, PROJECT_VERSION);
+		}
 
-				if (strcmp(version_str, PROJECT_VERSION) != 0) {
-					g_error("Version mismatch: client version %s, server version %s",
-					        version_str, PROJECT_VERSION);
-				}
-			} else {
-				g_error("Error reading version: %s",
-				        error->message);
-			}
-
-			// Read filesize
-			if (g_input_stream_read_all(input_stream, &remote_filesize,
-			                            sizeof(remote_filesize),
-			                            &bytes_read, NULL,
-			                            &error)) {
-				if (bytes_read != sizeof(remote_filesize)) {
-					g_error("protocol error: bytes_read(%zu) unequal to expected %zu", bytes_read,
-					        sizeof(remote_filesize));
-				}
+		g_debug("Received remote_filesize: %" G_GUINT64_FORMAT, pre.filesize);
 
-				g_debug("Received remote_filesize: %" G_GSIZE_FORMAT, remote_filesize);
+		if (pre.filesize != cs->filesize) {
+			g_error("not yet supported: remote_filesize (%" G_GUINT64_FORMAT
+			        ") differ from local filesize (%" G_GSIZE_FORMAT ")",
+			        pre.filesize, cs->filesize);
+		}
 
-				if (remote_filesize != cs->filesize) {
-					g_error("not yet supported: remote_filesize (%" G_GSIZE_FORMAT
-					        ") differ from local filesize (% " G_GSIZE_FORMAT ")",
-					        remote_filesize, cs->filesize);
-				}
-			} else {
-				g_error("Error reading chunk num: %s", error->message);
+		if (pre.chunk_count != cs->chunk_count) {
+			g_error("protocol error: remote chunk count %" G_GUINT64_FORMAT
+			        " differs from local %" G_GUINT64_FORMAT,
+			        pre.chunk_count, cs->chunk_count);
+		}
+
+		// Read chunk mask
+		if (!g_input_stream_read_all(input_stream, cs->chunk_mask,
+		                             QC_MASK_BYTES(cs->chunk_count),
+		                             &bytes_read, NULL,
+		                             &error)) {
+			g_error("Error reading chunk mask: %s", error->message);
+		}
+
+		if (bytes_read != QC_MASK_BYTES(cs->chunk_count)) {
+			g_error("protocol error: bytes_read(%zu) unequal to expected %" G_GUINT64_FORMAT,
+			        bytes_read, QC_MASK_BYTES(cs->chunk_count));
+		}
+
+		g_debug("Received chunk mask, %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+		        " chunks selected", chunk_mask_count(cs), cs->chunk_count);
+
+		// Read session flags
+		if (!g_input_stream_read_all(input_stream, &session_flags,
+		                             sizeof(session_flags), &bytes_read, NULL,
+		                             &error)) {
+			g_error("Error reading session flags: %s", error->message);
+		}
+
+		if (session_flags & ~(guint64)(QC_SESSION_ROLLING | QC_SESSION_PLAN |
+		                               QC_SESSION_SPECULATE | QC_SESSION_PARTIAL) ||
+		    (session_flags & QC_SESSION_ROLLING && session_flags & QC_SESSION_PLAN) ||
+		    (session_flags & QC_SESSION_SPECULATE && session_flags & QC_SESSION_PLAN)) {
+			g_error("protocol error: unknown session flags 0x%" G_GINT64_MODIFIER "x",
+			        session_flags);
+		}
+
+		if (session_flags & QC_SESSION_PARTIAL) {
+			receive_dirty_blocks(cs, input_stream);
+		}
+
+		if (session_flags & QC_SESSION_SPECULATE) {
+			if (!g_input_stream_read_all(input_stream, &cs->server->spec_budget,
+			                             sizeof(cs->server->spec_budget), &bytes_read,
+			                             NULL, &error)) {
+				g_error("Error reading in-flight budget: %s", error->message);
+			}
+
+			if (!cs->server->spec_budget || cs->server->spec_budget > QC_MAX_SPECULATE) {
+				g_error("protocol error: in-flight budget of %" G_GUINT64_FORMAT " chunks",
+				        cs->server->spec_budget);
+			}
+
+			/* Each pending chunk holds its data in memory, the server sets the limit */
+			cs->server->spec_budget = MIN(cs->server->spec_budget,
+			                              (guint64)(cs->speculate ? cs->speculate :
+			                                        QC_MAX_SPEC_PENDING_SERVER));
+
+			if (!g_output_stream_write_all(output_stream, &cs->server->spec_budget,
+			                               sizeof(cs->server->spec_budget),
+			                               &bytes_written, NULL, &error)) {
+				g_error("Error sending in-flight budget: %s", error->message);
 			}
 
-			cs->misc_received = TRUE;
+			cs->server->spec_pending = g_queue_new();
+			g_message("Speculative session, up to %" G_GUINT64_FORMAT
+			          " chunks in flight", cs->server->spec_budget);
 		}
 
+		cs->cursor = 1;
+
+		if (session_flags & QC_SESSION_ROLLING) {
+			if (!cs->server->roll) {
+				g_error("Client asked for a rolling session, start the server with --roll-state");
+			}
+
+			// Send where the previous window stopped
+			cs->cursor = cs->server->roll->cursor;
+
+			if (!g_output_stream_write_all(output_stream, &cs->cursor, sizeof(cs->cursor),
+			                               &bytes_written, NULL, &error)) {
+				g_error("Error sending cursor: %s", error->message);
+			}
+
+			g_message("Rolling session, starting at chunk %" G_GUINT64_FORMAT, cs->cursor);
+		}
+
+		if (session_flags & QC_SESSION_PLAN) {
+			g_message("Plan session, the file is not written");
+			plan_receive_probe(cs, input_stream, output_stream);
+		}
+
+		cs->misc_received = TRUE;
+
+		g_mutex_lock(&cs->server->mutex);
+		cs->server->session_started = TRUE;
+		g_cond_signal(&cs->server->session_cond);
+		g_mutex_unlock(&cs->server->mutex);
+	}
+
+	while (TRUE) {
 		// Read chunk num
 		if (g_input_stream_read_all(input_stream, &chnk->num, sizeof(chnk->num),
 		                            &bytes_read, NULL,
@@ -109,55 +897,108 @@ on_incoming_connection(GThreadedSocketService *self,
 
 			if (chnk->num < 0) {
 				g_debug("Client sent negative num, means end of transmission");
+				resolve_all_speculative(cs, fp, output_stream);
 				break;
 			}
 
-			if (chnk->num != current_num) {
-				g_error("Sync issue: chnk->num (%" G_GINT64_FORMAT
-				        ") is unequal to current_num %" G_GINT64_FORMAT,
-				        chnk->num, current_num);
+			if (chnk->num == 0) {
+				g_debug("Client asks for all pending verdicts");
+				resolve_all_speculative(cs, fp, output_stream);
+				send_message(output_stream, QC_ACK_MESSAGE);
+				continue;
 			}
 		} else {
+			report_damaged(cs);
 			g_error("Error reading chunk num: %s", error->message);
 		}
 
-		// Read chunk size
-		if (g_input_stream_read_all(input_stream, &chnk->size, sizeof(chnk->size),
-		                            &bytes_read, NULL,
-		                            &error)) {
-			if (bytes_read != sizeof(chnk->size)) {
-				g_error("protocol error: bytes_read(%zu) unequal to expected %zu", bytes_read,
-				        sizeof(chnk->size));
-			}
+		// Read chunk size, hash and flags
+		guint8 record[QC_RECORD_SIZE];
+		struct qc_record rec;
+
+		if (!g_input_stream_read_all(input_stream, record, sizeof(record), &bytes_read,
+		                             NULL, &error)) {
+			g_error("Error reading chunk header: %s", error->message);
+		}
+
+		if (bytes_read != sizeof(record)) {
+			g_error("protocol error: bytes_read(%zu) unequal to expected %zu", bytes_read,
+			        sizeof(record));
+		}
+
+		qc_record_decode(record, &rec);
+		chnk->size = rec.size;
+		chnk->hash.low64 = rec.hash_low64;
+		chnk->hash.high64 = rec.hash_high64;
+		chunk_flags = rec.flags;
+
+		g_debug("Received chunk->size: %" G_GSIZE_FORMAT ", chunk->hash: 0x%lx%lx",
+		        chnk->size, chnk->hash.high64, chnk->hash.low64);
+
+		if (chnk->num > (gint64) cs->chunk_count) {
+			g_error("protocol error: chunk %" G_GINT64_FORMAT " beyond the file", chnk->num);
+		}
+
+		/* With dirty blocks, the data covers only those */
+		extents = chunk_extents(cs, chnk->num, &chnk->partial);
+
+		if (chnk->size <= 0 || chnk->size != extents_size(extents)) {
+			g_error("chunk->size issue");
+		}
+
+		g_array_free(extents, TRUE);
+
+		if (chnk->hash.low64 == 0 && chnk->hash.high64 == 0) {
+			g_error("chunk->hash issue");
+		}
 
-			g_debug("Received chunk->size: %" G_GSIZE_FORMAT, chnk->size);
+		if (chunk_flags & ~(guint64)(QC_CHUNK_SPECULATIVE | QC_CHUNK_RESEND) ||
+		    (chunk_flags && !cs->server->spec_pending)) {
+			g_error("protocol error: unexpected chunk flags 0x%" G_GINT64_MODIFIER "x",
+			        chunk_flags);
+		}
+
+		if (chunk_flags & QC_CHUNK_SPECULATIVE) {
+			receive_speculative(cs, input_stream, chnk);
 
-			if (chnk->size <= 0 || chnk->size > QC_CHUNK_SIZE) {
-				g_error("chunk->size issue");
+			/* Over budget, the client waits for the oldest verdict */
+			if (g_queue_get_length(cs->server->spec_pending) >= cs->server->spec_budget) {
+				resolve_speculative(cs, fp, output_stream);
 			}
-		} else {
-			g_error("Error reading chunk->size: %s", error->message);
+
+			continue;
 		}
 
-		// Read chunk hash
-		if (g_input_stream_read_all(input_stream, &chnk->hash, sizeof(chnk->hash),
-		                            &bytes_read, NULL,
-		                            &error)) {
-			if (bytes_read != sizeof(chnk->hash)) {
-				g_error("protocol error: bytes_read(%zu) unequal to expected %zu", bytes_read,
-				        sizeof(chnk->hash));
+		/* Verdicts go out in order, pending chunks come first */
+		resolve_all_speculative(cs, fp, output_stream);
+
+		if (chunk_flags & QC_CHUNK_RESEND) {
+			/* The verdict was RTY, the comparison is done already */
+			server_index_remove(cs, chnk->num);
+
+			if (!receive_chunk(cs, &rx, fp, chnk)) {
+				g_warning("Chunk %" G_GINT64_FORMAT " arrived damaged again", chnk->num);
+				g_hash_table_add(cs->server->damaged, GUINT_TO_POINTER(chnk->num));
+				send_message(output_stream, QC_RTY_MESSAGE);
+				continue;
 			}
 
-			g_debug("Received chunk->hash: 0x%lx%lx", chnk->hash.high64,
-			        chnk->hash.low64);
+			g_hash_table_remove(cs->server->damaged, GUINT_TO_POINTER(chnk->num));
 
-			if (chnk->hash.low64 == 0 && chnk->hash.high64 == 0) {
-				g_error("chunk->hash issue");
+			if (!chnk->partial) {
+				server_index_add(cs, chnk->num, chnk->hash, chnk->size);
 			}
-		} else {
-			g_error("Error reading chunk->hash: %s", error->message);
+
+			if (cs->verify == QC_VERIFY_FULL) {
+				verify_queue_push(cs, fp, chnk);
+			}
+
+			send_message(output_stream, QC_ACK_MESSAGE);
+			continue;
 		}
 
+		current_hash = wait_for_current(cs, chnk->num);
+
 		g_debug("current_hash: 0x%lx%lx,  received chnk->hash: 0x%lx%lx",
 		        current_hash.high64, current_hash.low64,
 		        chnk->hash.high64, chnk->hash.low64);
@@ -171,6 +1012,46 @@ on_incoming_connection(GThreadedSocketService *self,
 			                               &error)) {
 				g_error("Error sending EQL: %s", error->message);
 			}
+
+			state = QC_CHANGE_EQUAL;
+		} else if (session_flags & QC_SESSION_PLAN) {
+			gboolean found = !chnk->partial &&
+			                 server_index_lookup(cs, chnk->hash, chnk->size) > 0;
+
+			// Send what would happen, but receive and write nothing
+			if (!g_output_stream_write_all(output_stream,
+			                               found ? QC_CPY_MESSAGE : QC_ACK_MESSAGE,
+			                               strlen(QC_ACK_MESSAGE), &bytes_written, NULL,
+			                               &error)) {
+				g_error("Error sending plan verdict: %s", error->message);
+			}
+
+			state = found ? QC_CHANGE_COPIED : QC_CHANGE_DIRTY;
+		} else if (!chnk->partial &&
+		           (src_num = server_index_lookup(cs, chnk->hash, chnk->size)) > 0) {
+			g_debug("HASH FOUND AT CHUNK %" G_GINT64_FORMAT " - copy locally", src_num);
+
+			// Send CPY
+			if (!g_output_stream_write_all(output_stream, QC_CPY_MESSAGE,
+			                               strlen(QC_CPY_MESSAGE), &bytes_written, NULL,
+			                               &error)) {
+				g_error("Error sending CPY: %s", error->message);
+			}
+
+			server_index_remove(cs, chnk->num);
+
+			if (copy_chunk(fp, src_num, chnk->num, chnk->size) != 0) {
+				g_error("Failed to copy chunk %" G_GINT64_FORMAT " to %" G_GINT64_FORMAT
+				        ": %s", src_num, chnk->num, g_strerror(errno));
+			}
+
+			server_index_add(cs, chnk->num, chnk->hash, chnk->size);
+			chunks_copied++;
+			state = QC_CHANGE_COPIED;
+
+			if (cs->verify == QC_VERIFY_FULL) {
+				verify_queue_push(cs, fp, chnk);
+			}
 		} else {
 			// Send ACK
 			if (!g_output_stream_write_all(output_stream, QC_ACK_MESSAGE,
@@ -179,43 +1060,60 @@ on_incoming_connection(GThreadedSocketService *self,
 				g_error("Error sending ACK: %s", error->message);
 			}
 
-			chnk->data = (gchar *) g_malloc(chnk->size * sizeof(gchar));
+			gint64 start_time = g_get_monotonic_time();
 
-			// Read chunk data and write it to fp
-			if (!g_input_stream_read_all(input_stream, chnk->data, chnk->size, &bytes_read,
-			                             NULL,
-			                             &error)) {
-				g_error("Error reading chunk data: %s", error->message);
-			}
+			/* Old content is gone from here on, never copy from it */
+			server_index_remove(cs, chnk->num);
 
-			if (bytes_read != chnk->size) {
-				g_error("ERROR: bytes_read %zu unequal to chunk size", bytes_read);
-			}
+			offset = (chnk->num - 1) * QC_CHUNK_SIZE;
 
-			gint64 start_time = g_get_monotonic_time();
+			for (retries = 0; !(intact = receive_chunk(cs, &rx, fp, chnk)); retries++) {
+				/* The damaged data is on disk already */
+				g_hash_table_add(cs->server->damaged, GUINT_TO_POINTER(chnk->num));
+
+				if (retries >= QC_MAX_RETRIES) {
+					break;
+				}
+
+				g_warning("Chunk %" G_GINT64_FORMAT " arrived damaged, requesting it again",
+				          chnk->num);
+
+				// Send RTY
+				if (!g_output_stream_write_all(output_stream, QC_RTY_MESSAGE,
+				                               strlen(QC_RTY_MESSAGE), &bytes_written, NULL,
+				                               &error)) {
+					g_error("Error sending RTY: %s", error->message);
+				}
+			}
 
-			fseek(fp, offset, SEEK_SET);
+			if (!intact) {
+				/* Keep it out of the index and end the session without committing */
+				g_critical("Chunk %" G_GINT64_FORMAT " still damaged after %d retries, giving up",
+				           chnk->num, retries);
+				send_message(output_stream, QC_NOK_MESSAGE);
+				break;
+			}
 
-			fw_nb = fwrite(chnk->data, 1, chnk->size, fp);
+			g_hash_table_remove(cs->server->damaged, GUINT_TO_POINTER(chnk->num));
 
-			g_free(chnk->data);
+			if (!chnk->partial) {
+				server_index_add(cs, chnk->num, chnk->hash, chnk->size);
+			}
+			state = QC_CHANGE_DIRTY;
 
-			if (fw_nb != chnk->size) {
-				g_error("Fail to write %" G_GSIZE_FORMAT " bytes, did: %&lu", chnk->size,
-				        fw_nb);
+			if (cs->verify == QC_VERIFY_FULL) {
+				verify_queue_push(cs, fp, chnk);
 			}
 
 			gint64 end_time = g_get_monotonic_time();
 			gint64 elapsed_microseconds = 1 + (end_time - start_time);
 
 			gdouble throughput = (gdouble)chnk->size / elapsed_microseconds;
-			g_info("Wrote %" G_GSIZE_FORMAT
+			g_info("Received and wrote %" G_GSIZE_FORMAT
 			       " bytes at offset %li in %.2lf seconds. Throughput: %.2lf MB/s",
 			       chnk->size, offset, elapsed_microseconds / 1e6, throughput);
 		}
 
-		offset += chnk->size;
-
 		// Send ACK
 		if (!g_output_stream_write_all(output_stream, QC_ACK_MESSAGE,
 		                               strlen(QC_ACK_MESSAGE), &bytes_written, NULL,
@@ -223,18 +1121,116 @@ on_incoming_connection(GThreadedSocketService *self,
 			g_error("Error sending final chunk ACK: %s", error->message);
 		}
 
-		g_mutex_lock(&cs->mutex);
-		cs->server_one_chunk_finished = TRUE;
-		g_cond_signal(&cs->cond);
-		g_mutex_unlock(&cs->mutex);
+		chunk_finished(cs, chnk, state);
+	}
+
+	/* Reader and worker stop here, even if the client ended early */
+	g_mutex_lock(&cs->mutex);
+	g_atomic_int_set(&cs->session_ended, TRUE);
+	g_cond_signal(&cs->cond);
+	g_mutex_unlock(&cs->mutex);
+
+	if (session_flags & QC_SESSION_PLAN) {
+		plan_send_rates(cs, output_stream);
 	}
 
+	/* A window only counts once its data is on disk */
+	if ((session_flags & QC_SESSION_ROLLING) && (fflush(fp) || fsync(fileno(fp)))) {
+		g_error("Failed to sync %s: %s", cs->filename, g_strerror(errno));
+	}
+
+	if (cs->server->spec_pending) {
+		g_queue_free(cs->server->spec_pending);
+		cs->server->spec_pending = NULL;
+	}
+
+	receive_ctx_clear(&rx);
 	fclose(fp);
 	g_free(chnk);
 
+	if (cs->server->verify_thread) {
+		struct chunk *end = g_new0(struct chunk, 1);
+
+		end->num = -1;
+		g_async_queue_push(cs->server->verify_queue, end);
+		g_thread_join(cs->server->verify_thread);
+		g_async_queue_unref(cs->server->verify_queue);
+
+		if (cs->server->verify_failures) {
+			g_critical("%" G_GUINT64_FORMAT " chunks failed the read-after-write check",
+			           cs->server->verify_failures);
+		} else {
+			g_message("All written chunks verified on disk");
+		}
+	}
+
+	/* Nothing of a session with damaged data counts as synced */
+	failed = g_hash_table_size(cs->server->damaged) || cs->server->verify_failures;
+
+	if (failed) {
+		report_damaged(cs);
+		cs->session_failed = TRUE;
+	}
+
+	if (cs->server->change_map && !(session_flags & QC_SESSION_PLAN) && !failed) {
+		if (changemap_save(cs->server->change_map, cs->change_map)) {
+			g_error("Unable to save change map %s", cs->change_map);
+		}
+	}
+
+	if (cs->server->change_map) {
+		changemap_free(cs->server->change_map);
+		cs->server->change_map = NULL;
+	}
+
+	if ((session_flags & QC_SESSION_ROLLING) && !failed) {
+		roll_state_commit(cs->server->roll, cs, cs->server->chunks_handled,
+		                  cs->server->last_num);
+
+		if (roll_state_save(cs->server->roll, cs->roll_state)) {
+			g_error("Unable to save rolling state %s", cs->roll_state);
+		}
+
+		if (cs->stale_windows) {
+			roll_state_report(cs->server->roll, cs->stale_windows);
+		}
+	}
+
+	if (chunks_copied) {
+		g_message("Copied %" G_GUINT64_FORMAT " relocated chunks locally instead of receiving them",
+		          chunks_copied);
+	}
+
+	g_mutex_lock(&cs->server->mutex);
+	cs->server->session_finished = TRUE;
+	g_cond_signal(&cs->server->session_cond);
+	g_mutex_unlock(&cs->server->mutex);
+
 	return FALSE; // Return FALSE so that the connection will be closed after the callback is done
 }
 
+void server_wait_for_session(struct cs_data *cs)
+{
+	g_mutex_lock(&cs->server->mutex);
+
+	while (!cs->server->session_started) {
+		g_cond_wait(&cs->server->session_cond, &cs->server->mutex);
+	}
+
+	g_mutex_unlock(&cs->server->mutex);
+}
+
+void server_wait_for_session_end(struct cs_data *cs)
+{
+	g_mutex_lock(&cs->server->mutex);
+
+	while (!cs->server->session_finished) {
+		g_cond_wait(&cs->server->session_cond, &cs->server->mutex);
+	}
+
+	g_mutex_unlock(&cs->server->mutex);
+}
+
 gint init_server(struct cs_data *cs)
 {
 	GSocketAddress *address;
@@ -244,6 +1240,11 @@ gint init_server(struct cs_data *cs)
 		return 0;
 	}
 
+	g_mutex_init(&cs->server->index_mutex);
+	cs->server->index = g_hash_table_new(hash128_hash, hash128_equal);
+	cs->server->index_entries = g_new0(struct index_entry, cs->chunk_count + 1);
+	cs->server->damaged = g_hash_table_new(NULL, NULL);
+
 	cs->server->service = g_threaded_socket_service_new(1);
 
 	// Add the service to listen on specified ip and port
@@ -277,5 +1278,10 @@ gint deinit_server(struct cs_data *cs)
 
 	g_object_unref(service);
 
+	g_hash_table_destroy(cs->server->index);
+	g_hash_table_destroy(cs->server->damaged);
+	g_free(cs->server->index_entries);
+	g_mutex_clear(&cs->server->index_mutex);
+
 	return 0;
 }
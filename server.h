@@ -9,6 +9,11 @@
 #include "quickchunk.h"
 
 gint init_server(struct cs_data *cs);
+void server_wait_for_session(struct cs_data *cs);
+void server_wait_for_session_end(struct cs_data *cs);
+void server_index_add(struct cs_data *cs, gint64 num, XXH128_hash_t hash,
+                      gsize size);
+void server_index_scan(struct cs_data *cs, FILE *fp);
 gint deinit_server(struct cs_data *cs);
 
 #endif //QUICKCHUNK_SERVER_H